@@ -0,0 +1,618 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include "utils/Async.h"
+#include "utils/Byte.h"
+#include "utils/LuaEx.h"
+#include "utils/Thread.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+CEU_BEGIN_NAMESPACE(AsyncXS) {
+	//
+	struct Future;
+
+	//
+	struct Deferred : DeferredQueue {
+		std::mutex mMutex;	// Guards posted tasks
+		std::vector<DeferredTask> mPosted;	// Tasks posted since the last frame
+		std::deque<DeferredTask> mPending;	// Tasks carried over to the current frame, only touched on the main state
+		std::atomic<size_t> mCount{0U};	// Posted and pending tasks
+		std::atomic<double> mBudget{4.0};	// Milliseconds per frame
+
+		void Post (DeferredTask task) override
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			mPosted.push_back(std::move(task));
+
+			++mCount;
+		}
+
+		size_t GetPendingCount (void) override { return mCount; }
+		double GetBudget (void) override { return mBudget; }
+		void SetBudget (double ms) override { mBudget = ms; }
+	};
+
+	// Per-state bookkeeping for futures, channels, and deferred tasks
+	struct Manager {
+		std::mutex mMutex;	// Guards completed list
+		std::vector<Future *> mCompleted;	// Futures whose jobs are done, awaiting resolution
+		std::atomic<size_t> mRunning{0U};	// Number of jobs in progress
+		int mInFlight{LUA_NOREF};	// Table of unresolved futures, keeping them alive while workers use them
+		int mListeners{LUA_NOREF};	// Table of channel listeners, keyed by channel handle
+		Deferred mDeferred;	// Main state tasks
+	};
+
+	//
+	struct Future {
+		enum State { eRunning, eFinished, eResolved, eFailed };
+
+		Job * mJob;	// Work being done
+		Manager * mManager;	// Manager that will resolve this
+		std::atomic<int> mState{eRunning};	// Current state
+		std::string mError;	// Error thrown by job, if any
+
+		void WaitUntilFinished (void)
+		{
+			while (mState == eRunning) std::this_thread::yield();
+		}
+	};
+
+	//
+	#define FUTURE_NAME "xs.future"
+
+	//
+	static void Resolve (lua_State * L, Future * future)
+	{
+		lua_getfenv(L, -1);	// ..., future, env
+
+		int env = lua_gettop(L), top = env;
+
+		if (future->mJob->mControl.IsCancelled() && future->mError.empty()) future->mError = "Cancelled";
+
+		bool bOK = future->mError.empty();
+
+		if (bOK)
+		{
+			lua_pushcfunction(L, [](lua_State * L)
+			{
+				Job * job = LuaXS::UD<Job>(L, 1);
+
+				lua_pop(L, 1);	// (empty)
+
+				return job->Push(L);// results
+			});	// ..., future, env, push
+			lua_pushlightuserdata(L, future->mJob);	// ..., future, env, push, job
+
+			bOK = lua_pcall(L, 1, LUA_MULTRET, 0) == 0;	// ..., future, env, results... / err
+		}
+
+		else lua_pushstring(L, future->mError.c_str());	// ..., future, env, err
+
+		// Store the results, or error, in the environment.
+		if (bOK)
+		{
+			int n = lua_gettop(L) - top;
+
+			for (int i = n; i >= 1; --i) lua_rawseti(L, env, i);// ..., future, env = { results... }
+
+			lua_pushinteger(L, n);	// ..., future, env, n
+			lua_setfield(L, env, "n");	// ..., future, env = { results..., n = n }
+		}
+
+		else lua_setfield(L, env, "err");	// ..., future, env = { err = err }
+
+		future->mState = bOK ? Future::eResolved : Future::eFailed;
+
+		lua_getfield(L, env, "callback");	// ..., future, env, callback?
+		lua_pushnil(L);	// ..., future, env, callback?, nil
+		lua_setfield(L, env, "callback");	// ..., future, env = { ..., callback = nil }, callback?
+		lua_replace(L, env);// ..., future, callback?
+	}
+
+	//
+	static int Update (lua_State * L)
+	{
+		Manager * manager = LuaXS::UD<Manager>(L, lua_upvalueindex(1));
+		std::vector<Future *> completed;
+
+		{
+			std::lock_guard<std::mutex> lock{manager->mMutex};
+
+			completed.swap(manager->mCompleted);
+		}
+
+		lua_settop(L, 1);	// event
+		lua_getref(L, manager->mInFlight);	// event, in_flight
+		lua_pushnil(L);	// event, in_flight, nil
+
+		bool bFailed = false;
+
+		for (Future * future : completed)
+		{
+			lua_pushlightuserdata(L, future);	// event, in_flight, err?, future_ptr
+			lua_rawget(L, 2);	// event, in_flight, err?, future
+
+			Resolve(L, future);	// event, in_flight, err?, future, callback?
+
+			if (lua_isfunction(L, 5))
+			{
+				lua_insert(L, 4);	// event, in_flight, err?, callback, future
+
+				if (lua_pcall(L, 1, 0, 0) != 0 && !bFailed)	// event, in_flight, err?[, new_err]
+				{
+					lua_replace(L, 3);	// event, in_flight, new_err
+
+					bFailed = true;
+				}
+			}
+
+			lua_settop(L, 3);	// event, in_flight, err?
+			lua_pushlightuserdata(L, future);	// event, in_flight, err?, future_ptr
+			lua_pushnil(L);	// event, in_flight, err?, future_ptr, nil
+			lua_rawset(L, 2);	// event, in_flight = { ..., [future_ptr] = nil }, err?
+		}
+
+		// Deliver channel payloads. Listeners may be added or removed along the way, so traverse a copy.
+		lua_getref(L, manager->mListeners);	// event, in_flight, err?, listeners
+		lua_newtable(L);// event, in_flight, err?, listeners, copy
+
+		int n = 0;
+
+		for (lua_pushnil(L); lua_next(L, 4); ++n)	// event, in_flight, err?, listeners, copy, channel, listener
+		{
+			lua_rawseti(L, 5, 2 * n + 2);	// event, in_flight, err?, listeners, copy = { ..., listener }, channel
+			lua_pushvalue(L, -1);	// event, in_flight, err?, listeners, copy, channel, channel
+			lua_rawseti(L, 5, 2 * n + 1);	// event, in_flight, err?, listeners, copy = { ..., channel, listener }, channel
+		}
+
+		std::string payload;
+
+		for (int i = 0; i < n; ++i)
+		{
+			lua_rawgeti(L, 5, 2 * i + 1);	// event, in_flight, err?, listeners, copy, channel
+			lua_rawgeti(L, 5, 2 * i + 2);	// event, in_flight, err?, listeners, copy, channel, listener
+
+			Channel * channel = LuaXS::UD<std::shared_ptr<Channel>>(L, 6)->get();
+
+			for (size_t count = channel->GetCapacity(); count && channel->Pop(payload); --count)	// Leave later arrivals for the next frame
+			{
+				lua_pushvalue(L, 7);// event, in_flight, err?, listeners, copy, channel, listener, listener
+				lua_pushlstring(L, payload.data(), payload.size());	// event, in_flight, err?, listeners, copy, channel, listener, listener, payload
+
+				if (lua_pcall(L, 1, 0, 0) != 0)	// event, in_flight, err?, listeners, copy, channel, listener[, new_err]
+				{
+					if (!bFailed) lua_replace(L, 3);// event, in_flight, new_err, listeners, copy, channel, listener
+
+					else lua_pop(L, 1);	// event, in_flight, err, listeners, copy, channel, listener
+
+					bFailed = true;
+				}
+			}
+
+			lua_settop(L, 5);	// event, in_flight, err?, listeners, copy
+		}
+
+		// Run deferred tasks, until out of time.
+		Deferred & deferred = manager->mDeferred;
+
+		{
+			std::lock_guard<std::mutex> lock{deferred.mMutex};
+
+			for (auto & task : deferred.mPosted) deferred.mPending.push_back(std::move(task));
+
+			deferred.mPosted.clear();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		std::chrono::duration<double, std::milli> budget{deferred.mBudget.load()};
+
+		lua_settop(L, 3);	// event, in_flight, err?
+
+		while (!deferred.mPending.empty())
+		{
+			DeferredTask task{std::move(deferred.mPending.front())};
+
+			deferred.mPending.pop_front();
+
+			--deferred.mCount;
+
+			lua_pushcfunction(L, [](lua_State * L)
+			{
+				DeferredTask * task = LuaXS::UD<DeferredTask>(L, 1);
+
+				lua_settop(L, 0);	// (empty)
+
+				(*task)(L);
+
+				return 0;
+			});	// event, in_flight, err?, run
+			lua_pushlightuserdata(L, &task);// event, in_flight, err?, run, task
+
+			if (lua_pcall(L, 1, 0, 0) != 0)	// event, in_flight, err?[, new_err]
+			{
+				if (!bFailed) lua_replace(L, 3);// event, in_flight, new_err
+
+				else lua_pop(L, 1);	// event, in_flight, err
+
+				bFailed = true;
+			}
+
+			if (std::chrono::steady_clock::now() - start >= budget) break;
+		}
+
+		if (bFailed) lua_error(L);	// Report the first error, now that the batch is done
+
+		return 0;
+	}
+
+	//
+	static Manager * GetManager (lua_State * L)
+	{
+		static int sManagerKey;
+
+		lua_pushlightuserdata(L, &sManagerKey);	// ..., key
+		lua_rawget(L, LUA_REGISTRYINDEX);	// ..., manager?
+
+		Manager * manager = LuaXS::UD<Manager>(L, -1);
+
+		lua_pop(L, 1);	// ...
+
+		if (!manager)
+		{
+			lua_pushlightuserdata(L, &sManagerKey);	// ..., key
+
+			manager = LuaXS::NewTyped<Manager>(L);	// ..., key, manager
+
+			lua_newtable(L);// ..., key, manager, in_flight
+
+			manager->mInFlight = lua_ref(L, 1);	// ..., key, manager
+
+			lua_newtable(L);// ..., key, manager, listeners
+
+			manager->mListeners = lua_ref(L, 1);// ..., key, manager
+
+			LuaXS::AttachGC(L, [](lua_State * L)
+			{
+				Manager * manager = LuaXS::UD<Manager>(L, 1);
+
+				while (manager->mRunning) std::this_thread::yield();	// Jobs still refer to the manager
+
+				LuaXS::DestructTyped<Manager>(L);
+
+				return 0;
+			});
+
+			lua_pushvalue(L, -1);	// ..., key, manager, manager
+
+			LuaXS::AddRuntimeListener(L, "enterFrame", Update, 1);	// ..., key, manager
+
+			lua_rawset(L, LUA_REGISTRYINDEX);	// ...; registry = { ..., [key] = manager }
+		}
+
+		return manager;
+	}
+
+	//
+	DeferredQueue * GetDeferredQueue (lua_State * L)
+	{
+		if (!LuaXS::IsMainState(L)) luaL_error(L, "Deferred tasks must be set up from the main state");
+
+		return &GetManager(L)->mDeferred;
+	}
+
+	//
+	static void RunJob (void * context)
+	{
+		Future * future = static_cast<Future *>(context);
+		Manager * manager = future->mManager;
+
+		try {
+			if (!future->mJob->mControl.IsCancelled()) future->mJob->Run();
+		} catch (std::exception & ex) {
+			future->mError = ex.what();
+		} catch (...) {
+			future->mError = "Unknown error in job";
+		}
+
+		future->mState = Future::eFinished;	// Set before it can be resolved, which changes the state again
+
+		{
+			std::lock_guard<std::mutex> lock{manager->mMutex};
+
+			manager->mCompleted.push_back(future);
+		}
+
+		--manager->mRunning;// n.b. last use of manager
+	}
+
+	//
+	static Future * GetFuture (lua_State * L)
+	{
+		return LuaXS::CheckUD<Future>(L, 1, FUTURE_NAME);
+	}
+
+	//
+	void Start (lua_State * L, Job * job, int callback)
+	{
+		if (callback) callback = CoronaLuaNormalize(L, callback);
+
+		if (!LuaXS::IsMainState(L))
+		{
+			delete job;
+
+			luaL_error(L, "Jobs must be started from the main state");
+		}
+
+		Manager * manager = GetManager(L);
+		Future * future = LuaXS::NewTyped<Future>(L);	// ..., future
+
+		future->mJob = job;
+		future->mManager = manager;
+
+		LuaXS::AttachMethods(L, FUTURE_NAME, [](lua_State * L)
+		{
+			luaL_Reg methods[] = {
+				{
+					"__gc", [](lua_State * L)
+					{
+						Future * future = GetFuture(L);
+
+						future->WaitUntilFinished();// Only possible when closing the state
+
+						delete future->mJob;
+
+						LuaXS::DestructTyped<Future>(L);
+
+						return 0;
+					}
+				}, {
+					"cancel", [](lua_State * L)
+					{
+						GetFuture(L)->mJob->mControl.Cancel();
+
+						return 0;
+					}
+				}, {
+					"get", [](lua_State * L)
+					{
+						Future * future = GetFuture(L);
+
+						lua_getfenv(L, 1);	// future, env
+
+						switch (future->mState)
+						{
+						case Future::eResolved:
+							lua_getfield(L, 2, "n");// future, env, n
+
+							for (int i = 1, n = LuaXS::Int(L, 3); i <= n; ++i) lua_rawgeti(L, 2, i);	// future, env, n, results...
+
+							return lua_gettop(L) - 3;
+						case Future::eFailed:
+							lua_pushnil(L);	// future, env, nil
+							lua_getfield(L, 2, "err");	// future, env, nil, err
+
+							return 2;
+						default:
+							return LuaXS::PushMultipleArgsAndReturn(L, LuaXS::Nil{}, "Pending");	// future, env, nil, "Pending"
+						}
+					}
+				}, {
+					"getProgress", [](lua_State * L)
+					{
+						ThreadXS::LoopControl & control = GetFuture(L)->mJob->mControl;
+
+						return LuaXS::PushMultipleArgsAndReturn(L, control.mCompleted.load(), control.mTotal.load());	// future, completed, total
+					}
+				}, {
+					"isCancelled", [](lua_State * L)
+					{
+						return LuaXS::BoolResult(L, GetFuture(L)->mJob->mControl.IsCancelled());	// future, cancelled
+					}
+				}, {
+					"isDone", [](lua_State * L)
+					{
+						int state = GetFuture(L)->mState;
+
+						return LuaXS::BoolResult(L, state == Future::eResolved || state == Future::eFailed);	// future, done
+					}
+				},
+				{ nullptr, nullptr }
+			};
+
+			luaL_register(L, nullptr, methods);
+		});
+
+		lua_createtable(L, 0, 2);	// ..., future, env
+
+		if (callback && lua_isfunction(L, callback))
+		{
+			lua_pushvalue(L, callback);	// ..., future, env, callback
+			lua_setfield(L, -2, "callback");// ..., future, env = { callback = callback }
+		}
+
+		lua_setfenv(L, -2);	// ..., future
+
+		// Keep the future alive until it has been resolved.
+		lua_getref(L, manager->mInFlight);	// ..., future, in_flight
+		lua_pushlightuserdata(L, future);	// ..., future, in_flight, future_ptr
+		lua_pushvalue(L, -3);	// ..., future, in_flight, future_ptr, future
+		lua_rawset(L, -3);	// ..., future, in_flight = { ..., [future_ptr] = future }
+		lua_pop(L, 1);	// ..., future
+
+		++manager->mRunning;
+
+		ThreadXS::Launch(RunJob, future);
+	}
+
+	//
+	#define CHANNEL_NAME "xs.channel"
+
+	//
+	std::shared_ptr<Channel> GetChannel (const char * name, size_t capacity)
+	{
+		static std::mutex sMutex;
+		static std::map<std::string, std::weak_ptr<Channel>> sChannels;
+
+		std::lock_guard<std::mutex> lock{sMutex};
+
+		std::weak_ptr<Channel> & entry = sChannels[name];
+		std::shared_ptr<Channel> channel = entry.lock();
+
+		if (!channel)
+		{
+			channel = std::make_shared<Channel>(capacity);
+			entry = channel;
+		}
+
+		return channel;
+	}
+
+	//
+	static Channel * GetChannelFromHandle (lua_State * L)
+	{
+		return LuaXS::CheckUD<std::shared_ptr<Channel>>(L, 1, CHANNEL_NAME)->get();
+	}
+
+	//
+	void PushChannel (lua_State * L, const char * name, size_t capacity)
+	{
+		LuaXS::NewTyped<std::shared_ptr<Channel>>(L, GetChannel(name, capacity));	// ..., channel
+
+		LuaXS::AttachMethods(L, CHANNEL_NAME, [](lua_State * L)
+		{
+			luaL_Reg methods[] = {
+				{
+					"__gc", LuaXS::TypedGC<std::shared_ptr<Channel>>
+				}, {
+					"getCount", [](lua_State * L)
+					{
+						lua_pushinteger(L, lua_Integer(GetChannelFromHandle(L)->GetCount()));	// channel, count
+
+						return 1;
+					}
+				}, {
+					"push", [](lua_State * L)
+					{
+						Channel * channel = GetChannelFromHandle(L);
+						ByteReader reader{L, 2};
+
+						if (!reader.mBytes) lua_error(L);
+
+						return LuaXS::BoolResult(L, channel->Push(reader.mBytes, reader.mCount));	// channel, bytes, ok
+					}
+				}, {
+					"setListener", [](lua_State * L)
+					{
+						GetChannelFromHandle(L);
+
+						if (!LuaXS::IsMainState(L)) luaL_error(L, "Listeners must be set from the main state");
+						if (!lua_isnil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+
+						Manager * manager = GetManager(L);
+
+						lua_settop(L, 2);	// channel, listener?
+						lua_getref(L, manager->mListeners);	// channel, listener?, listeners
+						lua_insert(L, 1);	// listeners, channel, listener?
+						lua_rawset(L, 1);	// listeners = { ..., [channel] = listener? }
+
+						return 0;
+					}
+				},
+				{ nullptr, nullptr }
+			};
+
+			luaL_register(L, nullptr, methods);
+		});
+	}
+
+	//
+	static void SetNumber (lua_State * L, const char * name, lua_Number value)
+	{
+		lua_pushnumber(L, value);	// ..., t, value
+		lua_setfield(L, -2, name);	// ..., t = { ..., [name] = value }
+	}
+
+	//
+	static void SetSeconds (lua_State * L, const char * name, uint64_t ns)
+	{
+		SetNumber(L, name, lua_Number(ns) / 1e9);
+	}
+
+	//
+	void PushStats (lua_State * L, bool bReset)
+	{
+		ThreadXS::Stats stats = ThreadXS::GetStats(bReset);
+
+		lua_createtable(L, 0, 3);	// ..., stats
+		lua_pushboolean(L, ThreadXS::AreStatsEnabled());// ..., stats, enabled
+		lua_setfield(L, -2, "enabled");	// ..., stats = { enabled = enabled }
+		lua_createtable(L, int(stats.mWorkers.size()), 0);	// ..., stats, workers
+
+		for (size_t i = 0; i < stats.mWorkers.size(); ++i)
+		{
+			const ThreadXS::WorkerStats & ws = stats.mWorkers[i];
+
+			lua_createtable(L, 0, 6);	// ..., stats, workers, worker
+
+			SetNumber(L, "chunks", lua_Number(ws.mChunks));
+			SetSeconds(L, "busy", ws.mBusy);
+			SetSeconds(L, "idle", ws.mIdle);
+			SetSeconds(L, "steal", ws.mSteal);
+			SetNumber(L, "steals", lua_Number(ws.mSteals));
+			SetSeconds(L, "longestChunk", ws.mLongestChunk);
+
+			lua_rawseti(L, -2, int(i + 1));	// ..., stats, workers = { ..., worker }
+		}
+
+		lua_setfield(L, -2, "workers");	// ..., stats = { enabled, workers = workers }
+		lua_createtable(L, int(stats.mLoops.size()), 0);// ..., stats, loops
+
+		for (size_t i = 0; i < stats.mLoops.size(); ++i)
+		{
+			const ThreadXS::LoopStats & ls = stats.mLoops[i];
+
+			lua_createtable(L, 0, 7);	// ..., stats, loops, loop
+
+			SetNumber(L, "id", lua_Number(ls.mID));
+			SetNumber(L, "items", lua_Number(ls.mItems));
+			SetNumber(L, "chunks", lua_Number(ls.mChunks));
+			SetSeconds(L, "busy", ls.mBusy);
+			SetSeconds(L, "wall", ls.mWall);
+			SetSeconds(L, "longestChunk", ls.mLongestChunk);
+			SetNumber(L, "threads", lua_Number(ls.mThreads));
+
+			lua_rawseti(L, -2, int(i + 1));	// ..., stats, loops = { ..., loop }
+		}
+
+		lua_setfield(L, -2, "loops");	// ..., stats = { enabled, workers, loops = loops }
+	}
+CEU_CLOSE_NAMESPACE()
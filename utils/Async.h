@@ -0,0 +1,134 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#pragma once
+
+#include "CoronaLua.h"
+#include "utils/Namespace.h"
+#include "utils/Thread.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+CEU_BEGIN_NAMESPACE(AsyncXS) {
+	// Work to be done off the main thread, whose results are then delivered to Lua
+	struct Job {
+		ThreadXS::LoopControl mControl;	// Pass to parallel_for() so that Lua may cancel the job and watch its progress
+
+		virtual ~Job (void) {}
+
+		virtual void Run (void) = 0;// Called on a worker
+		virtual int Push (lua_State *) { return 0; }// Called on the main state once Run() is done; pushes results, returning their count
+	};
+
+	// Start job on a worker, taking ownership of it, and push a future for it. Futures are resolved
+	// in batches by an "enterFrame" listener: once that happens, future:isDone() returns true and
+	// future:get() returns the results, or nil and an error. If callback is the stack position of a
+	// function, it is called with the future upon resolution. Must be called from the main state.
+	// Lua may also call future:cancel(), after which the future resolves to nil, "Cancelled", and
+	// future:getProgress(), which returns the completed and total item counts of the job's loops.
+	void Start (lua_State * L, Job * job, int callback = 0);
+
+	// Call a job body, passing along the loop control if it accepts one
+	template<typename R> auto InvokeRun (R & run, ThreadXS::LoopControl & control, int) -> decltype(run(control), void())
+	{
+		run(control);
+	}
+
+	template<typename R> void InvokeRun (R & run, ThreadXS::LoopControl &, long)
+	{
+		run();
+	}
+
+	//
+	template<typename R, typename P> struct LambdaJob : Job {
+		R mRun;	// Body
+		P mPush;// Results pusher
+
+		LambdaJob (R && run, P && push) : mRun{std::move(run)}, mPush{std::move(push)}
+		{
+		}
+
+		void Run (void) override { InvokeRun(mRun, mControl, 0); }
+		int Push (lua_State * L) override { return mPush(L); }
+	};
+
+	template<typename R, typename P> void Start (lua_State * L, R && run, P && push, int callback = 0)
+	{
+		using run_type = typename std::decay<R>::type;
+		using push_type = typename std::decay<P>::type;
+
+		Start(L, new LambdaJob<run_type, push_type>{run_type(std::forward<R>(run)), push_type(std::forward<P>(push))}, callback);
+	}
+
+	// Bounded queue of byte payloads, found by name, so that luaproc states and native threads may
+	// post to the main state without waiting on it, or on one another
+	class Channel {
+		ThreadXS::RingQueue<std::string> mQueue;// Payloads yet to be delivered
+
+	public:
+		explicit Channel (size_t capacity) : mQueue{capacity}
+		{
+		}
+
+		bool Pop (std::string & payload) { return mQueue.TryPop(payload); }
+		bool Push (const void * bytes, size_t size) { return mQueue.TryPush(std::string{static_cast<const char *>(bytes), size}); }	// false if full
+		size_t GetCapacity (void) const { return mQueue.GetCapacity(); }
+		size_t GetCount (void) const { return mQueue.GetSizeApprox(); }
+	};
+
+	// Find the channel with this name, creating it if necessary; the capacity is only used then
+	std::shared_ptr<Channel> GetChannel (const char * name, size_t capacity = 1024U);
+
+	// Push a handle to the named channel. Any state may call channel:push(bytes), which returns
+	// false if the channel is full, and channel:getCount(). In the main state, channel:setListener(func)
+	// will, on each frame, call func(payload) for every payload waiting at that time; passing nil
+	// removes the listener.
+	void PushChannel (lua_State * L, const char * name, size_t capacity = 1024U);
+
+	// Work to be done on the main state, e.g. creating display objects from results computed natively
+	using DeferredTask = std::function<void (lua_State *)>;
+
+	// Queue of deferred tasks. An "enterFrame" listener runs them in order until the frame's
+	// budget is used up (at least one always runs), carrying the rest over to later frames.
+	// Any thread may post tasks. A task that raises an error is dropped; the first such error
+	// is reported once that frame's tasks are done.
+	class DeferredQueue {
+	public:
+		virtual ~DeferredQueue (void) {}
+
+		virtual void Post (DeferredTask task) = 0;
+		virtual size_t GetPendingCount (void) = 0;	// Tasks yet to run
+		virtual double GetBudget (void) = 0;// Milliseconds per frame
+		virtual void SetBudget (double ms) = 0;
+	};
+
+	// Get the main state's deferred queue, which lives until the state is closed. Must be called from the main state.
+	DeferredQueue * GetDeferredQueue (lua_State * L);
+
+	// Push a table of the scheduler counters gathered while ThreadXS::EnableStats() was on; see
+	// ThreadXS::Stats. Its "workers" and "loops" fields are arrays of tables, with times in seconds.
+	void PushStats (lua_State * L, bool bReset = false);
+CEU_END_NAMESPACE(AsyncXS)
@@ -26,10 +26,136 @@
 #include "utils/LuaEx.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <memory>
 #include <utility>
 
+#ifdef _WIN32
+	#include <Windows.h>
+#else
+	#include <sys/mman.h>
+	#include <unistd.h>
+
+	#ifdef MADV_HUGEPAGE
+		#define HAS_HUGE_PAGE_HINTS
+	#endif
+#endif
+
+MemoryXS::Stats::Stats (void)
+{
+	for (auto & count : mHistogram) count = 0U;
+}
+
+void MemoryXS::Stats::AddRequest (size_t size, bool bHit)
+{
+	int bucket = 0;
+
+	for (size_t limit = 16U; size > limit && bucket < eBucketCount - 1; limit *= 2U) ++bucket;
+
+	mHistogram[bucket].fetch_add(1U, std::memory_order_relaxed);
+	(bHit ? mHits : mMisses).fetch_add(1U, std::memory_order_relaxed);
+}
+
+void MemoryXS::Stats::OnAlloc (size_t size, bool bHit)
+{
+	if (!IsEnabled()) return;
+
+	AddRequest(size, bHit);
+
+	mAllocs.fetch_add(1U, std::memory_order_relaxed);
+
+	uint64_t live = mLive.fetch_add(size, std::memory_order_relaxed) + size, peak = mPeak.load(std::memory_order_relaxed);
+
+	while (peak < live && !mPeak.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+}
+
+void MemoryXS::Stats::OnFree (size_t size)
+{
+	if (!IsEnabled()) return;
+
+	mFrees.fetch_add(1U, std::memory_order_relaxed);
+
+	uint64_t live = mLive.load(std::memory_order_relaxed);
+
+	while (!mLive.compare_exchange_weak(live, live - (std::min)(live, uint64_t(size)), std::memory_order_relaxed));	// Allocations made while disabled may be freed
+}
+
+void MemoryXS::Stats::OnRealloc (size_t old_size, size_t size, bool bHit)
+{
+	if (!IsEnabled()) return;
+
+	AddRequest(size, bHit);
+
+	mReallocs.fetch_add(1U, std::memory_order_relaxed);
+
+	uint64_t live = mLive.load(std::memory_order_relaxed), updated;
+
+	do {
+		updated = live - (std::min)(live, uint64_t(old_size)) + size;
+	} while (!mLive.compare_exchange_weak(live, updated, std::memory_order_relaxed));
+
+	uint64_t peak = mPeak.load(std::memory_order_relaxed);
+
+	while (peak < updated && !mPeak.compare_exchange_weak(peak, updated, std::memory_order_relaxed));
+}
+
+void MemoryXS::Stats::Push (lua_State * L, bool bReset)
+{
+	uint64_t hits = mHits, misses = mMisses;
+
+	lua_createtable(L, 0, 11);	// ..., stats
+
+	const struct {
+		const char * mName;
+		uint64_t mValue;
+	} fields[] = {
+		{ "live", mLive }, { "peak", mPeak }, { "allocs", mAllocs }, { "frees", mFrees }, { "reallocs", mReallocs }, { "hits", hits }, { "misses", misses }
+	};
+
+	for (auto & field : fields)
+	{
+		lua_pushnumber(L, lua_Number(field.mValue));// ..., stats, value
+		lua_setfield(L, -2, field.mName);	// ..., stats = { ..., name = value }
+	}
+
+	lua_pushnumber(L, hits + misses > 0U ? lua_Number(hits) / lua_Number(hits + misses) : 0);	// ..., stats, rate
+	lua_setfield(L, -2, "hitRate");	// ..., stats = { ..., hitRate = rate }
+	lua_pushboolean(L, IsEnabled());// ..., stats, enabled
+	lua_setfield(L, -2, "enabled");	// ..., stats = { ..., enabled = enabled }
+	lua_createtable(L, eBucketCount, 0);// ..., stats, histogram
+
+	for (int i = 0; i < eBucketCount; ++i)
+	{
+		lua_pushnumber(L, lua_Number(mHistogram[i].load()));	// ..., stats, histogram, count
+		lua_rawseti(L, -2, i + 1);	// ..., stats, histogram = { ..., count }
+	}
+
+	lua_setfield(L, -2, "histogram");	// ..., stats = { ..., histogram = histogram }
+
+	if (bReset) Reset();
+}
+
+void MemoryXS::Stats::Reset (void)
+{
+	mPeak = mLive.load();
+	mAllocs = mFrees = mReallocs = mHits = mMisses = 0U;
+
+	for (auto & count : mHistogram) count = 0U;
+}
+
+int MemoryXS::SizeClasses::GetClass (size_t size)
+{
+	size_t total = size + eHeaderSize;
+
+	for (int shift = eMinShift; shift <= eMaxShift; ++shift)
+	{
+		if (total <= (size_t(1U) << shift)) return shift - eMinShift;
+	}
+
+	return -1;
+}
+
 MemoryXS::LuaMemory::BookmarkDualTables MemoryXS::LuaMemory::BindTable (void)
 {
 	BookmarkDualTables bm;
@@ -71,6 +197,9 @@ size_t MemoryXS::LuaMemory::GetOldSize (int slot, void * ptr)
 	PushObject(slot, ptr);	// ..., old
 
 	size_t oldsize = lua_objlen(mL, -1);
+	void * ud = lua_touserdata(mL, -1);
+
+	if (ud) oldsize -= size_t(static_cast<unsigned char *>(ptr) - static_cast<unsigned char *>(ud));	// Aligned blocks may begin partway in
 
 	lua_pop(mL, 1);	// ...
 
@@ -88,6 +217,136 @@ void * MemoryXS::LuaMemory::Add (int slot, size_t size)
 	return ud;
 }
 
+void * MemoryXS::LuaMemory::AddAligned (int slot, size_t size, size_t align, size_t prefix)
+{
+	void * ud = lua_newuserdata(mL, prefix + size + align - 1U);	// ..., ud
+	void * ptr = static_cast<unsigned char *>(ud) + prefix;
+
+	Align(align, size, ptr);
+
+	// Key the userdata by the start of the prefix, if any, which is where frees will look for it.
+	lua_pushlightuserdata(mL, static_cast<unsigned char *>(ptr) - prefix);	// ..., ud, key
+	lua_insert(mL, -2);	// ..., key, ud
+	lua_settable(mL, slot);	// ..., env = { ..., [key] = ud }, ...
+
+	return ptr;
+}
+
+// In slab mode, small allocations are carved out of large userdata, which belong to the memory
+// table just as ordinary allocations do, and recycled via per-size class free lists. Every block,
+// including the larger ones that still get their own userdata, is preceded by a header.
+struct MemoryXS::LuaMemory::SlabState : MemoryXS::SizeClasses {
+	struct Header {
+		SlabState * mState;	// State that owns block, or null if the block is its own userdata
+		size_t mSize;	// Requested size
+	};
+
+	void * mFree[eClassCount];	// Free blocks, per size class
+	unsigned char * mPos{nullptr};	// Next position in current slab
+	unsigned char * mEnd{nullptr};	// End of current slab
+
+	SlabState (void)
+	{
+		for (auto & head : mFree) head = nullptr;
+	}
+
+	static Header * GetHeader (void * ptr)
+	{
+		return reinterpret_cast<Header *>(static_cast<unsigned char *>(ptr) - eHeaderSize);
+	}
+
+	void Release (Header * header)
+	{
+		int index = GetClass(header->mSize);
+
+		*reinterpret_cast<void **>(header) = mFree[index];
+
+		mFree[index] = header;
+	}
+};
+
+static_assert(sizeof(MemoryXS::LuaMemory::SlabState::Header) <= MemoryXS::LuaMemory::SlabState::eHeaderSize, "Slab header too large");
+
+void * MemoryXS::LuaMemory::AddWithHeader (int slot, size_t size)
+{
+	int index = SlabState::GetClass(size);
+	SlabState::Header * header;
+
+	if (index < 0)
+	{
+		header = static_cast<SlabState::Header *>(Add(slot, SlabState::eHeaderSize + size));
+		header->mState = nullptr;
+	}
+
+	else
+	{
+		SlabState * state = GetSlabState(slot);
+
+		if (state->mFree[index])
+		{
+			header = static_cast<SlabState::Header *>(state->mFree[index]);
+			state->mFree[index] = *static_cast<void **>(state->mFree[index]);
+		}
+
+		else
+		{
+			size_t block_size = SlabState::GetBlockSize(index);
+
+			if (size_t(state->mEnd - state->mPos) < block_size)
+			{
+				state->mPos = static_cast<unsigned char *>(Add(slot, SlabState::eSlabSize));
+				state->mEnd = state->mPos + SlabState::eSlabSize;
+			}
+
+			header = reinterpret_cast<SlabState::Header *>(state->mPos);
+
+			state->mPos += block_size;
+		}
+
+		header->mState = state;
+	}
+
+	header->mSize = size;
+
+	return reinterpret_cast<unsigned char *>(header) + SlabState::eHeaderSize;
+}
+
+void MemoryXS::LuaMemory::FreeWithHeader (void * ptr)
+{
+	SlabState::Header * header = SlabState::GetHeader(ptr);
+
+	if (header->mState) header->mState->Release(header);
+
+	else
+	{
+		Remove(Begin(), header);// ...[, reg]
+		End();	// ...
+	}
+}
+
+MemoryXS::LuaMemory::SlabState * MemoryXS::LuaMemory::GetSlabState (int slot)
+{
+	static int sStateKey;
+
+	lua_pushlightuserdata(mL, &sStateKey);	// ..., key
+	lua_rawget(mL, slot);	// ..., state?
+
+	SlabState * state = LuaXS::UD<SlabState>(mL, -1);
+
+	lua_pop(mL, 1);	// ...
+
+	if (!state)
+	{
+		lua_pushlightuserdata(mL, &sStateKey);	// ..., key
+
+		state = LuaXS::NewTyped<SlabState>(mL);	// ..., key, state
+
+		lua_rawset(mL, slot);	// ..., t = { ..., [key] = state }, ...
+	}
+
+	return state;
+}
+
 int MemoryXS::LuaMemory::Begin (void)
 {
 	if (mRegistrySlot == LUA_NOREF) return mIndex;
@@ -147,6 +406,11 @@ void MemoryXS::LuaMemory::PrepRegistry (void)
 	mRegistrySlot = lua_ref(mL, 1);	// ...
 }
 
+void MemoryXS::LuaMemory::PrepSlabs (void)
+{
+	mSlabs = true;
+}
+
 void MemoryXS::LuaMemory::PushObject (int slot, void * ptr)
 {
 	lua_pushlightuserdata(mL, ptr);	// ..., ptr
@@ -175,13 +439,48 @@ void MemoryXS::LuaMemory::FailAssert (const char * what)
 
 void * MemoryXS::LuaMemory::Malloc (size_t size)
 {
-	void * ud = Add(Begin(), size);	// ...[, reg]
+	void * ud = mSlabs ? AddWithHeader(Begin(), size) : Add(Begin(), size);	// ...[, reg]
 
 	End();	// ...
 
+	mStats.OnAlloc(size, mSlabs && SlabState::GetClass(size) >= 0);
+
 	return ud;
 }
 
+void * MemoryXS::LuaMemory::MallocAligned (size_t size, size_t align)
+{
+	if (!IsValidAlignment(align)) FailAssert("Alignment must be a power of 2");
+	if (align <= eMinAlignment) return Malloc(size);
+
+	int slot = Begin();	// ...[, reg]
+	void * mem;
+
+	// In slab mode, an aligned block is its own userdata, with a header just ahead of it.
+	if (mSlabs)
+	{
+		mem = AddAligned(slot, size, align, SlabState::eHeaderSize);	// ...[, reg]
+
+		SlabState::Header * header = SlabState::GetHeader(mem);
+
+		header->mState = nullptr;
+		header->mSize = size;
+	}
+
+	else
+	{
+		mem = AddAligned(slot, size, align, 0U);// ...[, reg]
+
+		if (mStats.IsEnabled()) size = GetOldSize(slot, mem);	// Include the slack at the end, as frees will
+	}
+
+	End();	// ...
+
+	mStats.OnAlloc(size, false);
+
+	return mem;
+}
+
 void * MemoryXS::LuaMemory::Calloc (size_t num, size_t size)
 {
 	void * ud = Malloc(num * size);
@@ -202,11 +501,42 @@ void * MemoryXS::LuaMemory::Realloc (void * ptr, size_t size)
 
 	else if (!ptr) return Malloc(size);
 
+	else if (mSlabs)
+	{
+		SlabState::Header * header = SlabState::GetHeader(ptr);
+
+		size_t old_size = header->mSize;
+
+		mStats.OnRealloc(old_size, size, SlabState::GetClass(size) >= 0);
+
+		// Slab blocks stay put while the size remains in their class, and otherwise move, even when
+		// shrinking, since frees file a block by its size's class. Blocks with their own userdata stay
+		// put whenever they shrink.
+		if (header->mState ? SlabState::GetClass(size) == SlabState::GetClass(old_size) : size <= old_size)
+		{
+			header->mSize = size;
+
+			return ptr;
+		}
+
+		void * mem = AddWithHeader(Begin(), size);	// ...[, reg]
+
+		End();	// ...
+
+		memcpy(mem, ptr, (std::min)(old_size, size));
+
+		FreeWithHeader(ptr);
+
+		return mem;
+	}
+
 	else
 	{
 		int slot = Begin();	// ...[, reg]	
 		size_t oldsize = GetOldSize(slot, ptr);
 
+		mStats.OnRealloc(oldsize, (std::max)(oldsize, size), false);
+
 		if (oldsize < size)
 		{
 			void * ud = Add(slot, size);
@@ -228,12 +558,21 @@ void MemoryXS::LuaMemory::Free (void * ptr)
 {
 	if (!ptr) return;
 
-	Remove(Begin(), ptr);	// ...[, reg]
-	End();	// ...
+	if (mStats.IsEnabled()) mStats.OnFree(GetSize(ptr));
+
+	if (mSlabs) FreeWithHeader(ptr);
+
+	else
+	{
+		Remove(Begin(), ptr);	// ...[, reg]
+		End();	// ...
+	}
 }
 
 size_t MemoryXS::LuaMemory::GetSize (void * ptr)
 {
+	if (mSlabs) return ptr ? SlabState::GetHeader(ptr)->mSize : 0U;
+
 	size_t size = GetOldSize(Begin(), ptr);	// ...[, reg]
 
 	End();	// ...
@@ -245,6 +584,18 @@ bool MemoryXS::LuaMemory::Emit (void * ptr, bool bRemove)
 {
 	if (!ptr) return false;
 
+	// Slab blocks are not objects in their own right, so emit a copy.
+	if (mSlabs)
+	{
+		size_t size = GetSize(ptr);
+
+		memcpy(lua_newuserdata(mL, size), ptr, size);	// ..., ud
+
+		if (bRemove) Free(ptr);
+
+		return true;
+	}
+
 	int top = lua_gettop(mL);
 
 	lua_pushnil(mL);// ..., nil
@@ -255,7 +606,24 @@ bool MemoryXS::LuaMemory::Emit (void * ptr, bool bRemove)
 
 	lua_replace(mL, top + 1);	// ..., object?[, reg]
 
-	if (bRemove) Remove(slot, ptr);
+	// An aligned block may begin partway into its userdata, so emit a copy of just its part.
+	void * ud = lua_touserdata(mL, top + 1);
+
+	if (ud && ud != ptr)
+	{
+		size_t size = lua_objlen(mL, top + 1) - size_t(static_cast<unsigned char *>(ptr) - static_cast<unsigned char *>(ud));
+
+		memcpy(lua_newuserdata(mL, size), ptr, size);	// ..., object[, reg], copy
+
+		lua_replace(mL, top + 1);	// ..., copy[, reg]
+	}
+
+	if (bRemove && !lua_isnil(mL, top + 1))
+	{
+		mStats.OnFree(lua_objlen(mL, top + 1));
+
+		Remove(slot, ptr);
+	}
 
 	End();
 
@@ -302,138 +670,359 @@ void * MemoryXS::Align (size_t bound, size_t size, void *& ptr, size_t * space)
     #endif
 }
 
-MemoryXS::ScopedSystem * MemoryXS::ScopedSystem::New (lua_State * L)
+void * MemoryXS::AlignedMalloc (size_t size, size_t align)
 {
-	ScopedSystem * system = LuaXS::NewTyped<ScopedSystem>(L);	// ..., system
+	if (!IsValidAlignment(align)) return nullptr;
+	if (align < sizeof(void *)) align = sizeof(void *);
 
-	system->mL = L;
+	size_t extra = sizeof(void *) + align - 1U;
 
-	lua_pushlightuserdata(L, system);	// ..., system, system_ptr
-	lua_insert(L, -2);	// ..., system_ptr, system
-	lua_rawset(L, LUA_REGISTRYINDEX);	// ...; registry = { ..., [system_ptr] = system }
+	if (size > size_t(-1) - extra) return nullptr;
 
-	return system;
-}
+	void * base = malloc(size + extra);
 
-void MemoryXS::ScopedSystem::FailAssert (const char * what)
-{
-	luaL_error(mL, what);
-}
+	if (!base) return nullptr;
 
-void * MemoryXS::ScopedSystem::Malloc (size_t size)
-{
-	void * mem = mCurrent->AddToStack(size);
+	// Stash the original pointer just ahead of the aligned one, for AlignedFree().
+	void * ptr = static_cast<unsigned char *>(base) + sizeof(void *);
 
-	if (!mem) mem = malloc(size);
-	if (!mem) luaL_error(mL, "Out of memory");
+	Align(align, size, ptr);
 
-	mCurrent->mAllocs.push_back(MemoryXS::Scoped::Item{mem, size});
+	static_cast<void **>(ptr)[-1] = base;
 
-	return mem;
+	return ptr;
 }
 
-void * MemoryXS::ScopedSystem::Calloc (size_t num, size_t size)
+void MemoryXS::AlignedFree (void * ptr)
 {
-	void * mem = mCurrent->AddToStack(num * size);
+	if (ptr) free(static_cast<void **>(ptr)[-1]);
+}
 
-	if (mem) memset(mem, 0, num * size);
+size_t MemoryXS::PointerMap::Home (void * ptr) const
+{
+	uint64_t key = uint64_t(uintptr_t(ptr) >> 3U) * 0x9E3779B97F4A7C15ULL;	// Fibonacci hashing; low bits are mostly alignment
 
-	else mem = calloc(num, size);
+	return size_t(key >> 32U) & (mEntries.size() - 1U);
+}
 
-	if (!mem) luaL_error(mL, "Out of memory");
+size_t MemoryXS::PointerMap::Slot (void * ptr) const
+{
+	size_t mask = mEntries.size() - 1U, i = Home(ptr);
 
-	mCurrent->mAllocs.push_back(MemoryXS::Scoped::Item{mem, num * size});
+	while (mEntries[i].mPtr && mEntries[i].mPtr != ptr) i = (i + 1U) & mask;
 
-	return mem;
+	return i;
 }
 
-void * MemoryXS::ScopedSystem::Realloc (void * ptr, size_t size)
+void MemoryXS::PointerMap::Grow (void)
 {
-	//
-	if (size == 0U)
-	{
-		Free(ptr);
+	std::vector<Entry> old(mEntries.empty() ? 16U : mEntries.size() * 2U, Entry{nullptr, 0U});
 
-		return nullptr;
-	}
+	old.swap(mEntries);
 
-	else
+	for (auto & entry : old)
 	{
-		auto iter = mCurrent->Find(ptr);
+		if (entry.mPtr) mEntries[Slot(entry.mPtr)] = entry;
+	}
+}
 
-		//
-		if (iter != mCurrent->mAllocs.end())
-		{
-			bool bWasInStack = mCurrent->InStack(ptr);
+size_t * MemoryXS::PointerMap::Find (void * ptr)
+{
+	return const_cast<size_t *>(static_cast<const PointerMap *>(this)->Find(ptr));
+}
 
-            if (bWasInStack) mCurrent->TryToRewind(*iter);
+const size_t * MemoryXS::PointerMap::Find (void * ptr) const
+{
+	if (!ptr || mCount == 0U) return nullptr;
 
-			void * mem = mCurrent->AddToStack(size);
+	const Entry & entry = mEntries[Slot(ptr)];
 
-			if (!mem) mem = realloc(!bWasInStack ? ptr : nullptr, size);
-            if (!mem) luaL_error(mL, "Out of memory");
-            if (bWasInStack && mem != ptr) memcpy(mem, ptr, (std::min)(iter->mSize, size));
+	return entry.mPtr ? &entry.mValue : nullptr;
+}
 
-			// Replace the allocation entry. (Old stack space will be tombstoned.)
-			iter->mPtr = mem;
-			iter->mSize = size;
+bool MemoryXS::PointerMap::Insert (void * ptr, size_t value)
+{
+	if (!ptr || Find(ptr)) return false;
 
-			return mem;
-		}
+	if (2U * (mCount + 1U) > mEntries.size()) Grow();	// Keep the load at most 1/2
 
-		//
-		else return Malloc(size);
-	}
+	mEntries[Slot(ptr)] = Entry{ptr, value};
+
+	++mCount;
+
+	return true;
 }
 
-void MemoryXS::ScopedSystem::Free (void * ptr)
+bool MemoryXS::PointerMap::Erase (void * ptr)
 {
-	auto iter = mCurrent->Find(ptr);
+	if (!ptr || mCount == 0U) return false;
 
-	if (iter != mCurrent->mAllocs.end())
+	size_t mask = mEntries.size() - 1U, i = Slot(ptr);
+
+	if (!mEntries[i].mPtr) return false;
+
+	// Shift later members of the probe sequence back into the hole, rather than leaving tombstones.
+	for (size_t j = (i + 1U) & mask; mEntries[j].mPtr; j = (j + 1U) & mask)
 	{
-		if (mCurrent->InStack(iter->mPtr)) mCurrent->TryToRewind(*iter);
-		
-		else free(iter->mPtr);
+		size_t home = Home(mEntries[j].mPtr);
 
-		mCurrent->mAllocs.erase(iter);
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			mEntries[i] = mEntries[j];
+
+			i = j;
+		}
 	}
-}
 
-size_t MemoryXS::ScopedSystem::GetSize (void * ptr)
-{
-	auto iter = mCurrent->Find(ptr);
+	mEntries[i].mPtr = nullptr;
 
-	if (iter != mCurrent->mAllocs.end()) return iter->mSize;
+	--mCount;
 
-	return 0U;
+	return true;
 }
 
-void MemoryXS::ScopedSystem::Push (void * ptr, bool bRemove)
+void MemoryXS::PointerMap::Clear (void)
 {
-	lua_pushlstring(mL, static_cast<const char *>(ptr), GetSize(ptr));	// ..., bytes
+	for (auto & entry : mEntries) entry.mPtr = nullptr;
 
-	if (bRemove) Free(ptr);
+	mCount = 0U;
 }
 
-bool MemoryXS::Scoped::InStack (void * ptr) const
+MemoryXS::ScopedSystem * MemoryXS::ScopedSystem::New (lua_State * L)
 {
-	if (mStack.empty()) return false;
+	ScopedSystem * system = LuaXS::NewTyped<ScopedSystem>(L);	// ..., system
 
-	const unsigned char * stack = mStack.data();
+	LuaXS::AttachGC(L, LuaXS::TypedGC<ScopedSystem>);	// Release cached chunks along with the system
+
+	system->mL = L;
+
+	lua_pushlightuserdata(L, system);	// ..., system, system_ptr
+	lua_insert(L, -2);	// ..., system_ptr, system
+	lua_rawset(L, LUA_REGISTRYINDEX);	// ...; registry = { ..., [system_ptr] = system }
+
+	return system;
+}
+
+void MemoryXS::ScopedSystem::FailAssert (const char * what)
+{
+	luaL_error(mL, what);
+}
+
+void * MemoryXS::ScopedSystem::Malloc (size_t size)
+{
+	void * mem = mCurrent->AddToStack(size);
+
+	bool bHit = mem != nullptr;
+
+	if (!mem) mem = malloc(size);
+	if (!mem) luaL_error(mL, "Out of memory");
+
+	mCurrent->Add(mem, size);
+	mStats.OnAlloc(size, bHit);
+
+	return mem;
+}
+
+void * MemoryXS::ScopedSystem::MallocAligned (size_t size, size_t align)
+{
+	if (!IsValidAlignment(align)) luaL_error(mL, "Alignment must be a power of 2");
+	if (align <= eMinAlignment) return Malloc(size);
+
+	void * mem = mCurrent->AddToStack(size, align);
+
+	bool bHit = mem != nullptr;
+
+	if (!mem) mem = AlignedMalloc(size, align);
+	if (!mem) luaL_error(mL, "Out of memory");
+
+	mCurrent->Add(mem, size, !bHit);
+	mStats.OnAlloc(size, bHit);
+
+	return mem;
+}
+
+void * MemoryXS::ScopedSystem::Calloc (size_t num, size_t size)
+{
+	void * mem = mCurrent->AddToStack(num * size);
+	bool bHit = mem != nullptr;
+
+	if (mem) memset(mem, 0, num * size);
+
+	else mem = calloc(num, size);
+
+	if (!mem) luaL_error(mL, "Out of memory");
+
+	mCurrent->Add(mem, num * size);
+	mStats.OnAlloc(num * size, bHit);
+
+	return mem;
+}
+
+void * MemoryXS::ScopedSystem::Realloc (void * ptr, size_t size)
+{
+	//
+	if (size == 0U)
+	{
+		Free(ptr);
+
+		return nullptr;
+	}
+
+	else
+	{
+		Scoped * scope = FindScope(ptr);
+
+		//
+		if (scope)
+		{
+			auto iter = scope->Find(ptr);
+			bool bWasInStack = scope->InStack(ptr);
+
+            if (bWasInStack) scope->TryToRewind(*iter);
+
+			void * mem = bWasInStack ? scope->AddToStack(size) : nullptr;	// Heap blocks stay on the heap, since realloc() may grow them in place
+
+			if (!mem && iter->mAligned)	// realloc() cannot take aligned blocks, so move these into ordinary ones
+			{
+				mem = malloc(size);
+
+				if (mem)
+				{
+					memcpy(mem, ptr, (std::min)(iter->mSize, size));
+
+					AlignedFree(ptr);
+				}
+			}
+
+			else if (!mem) mem = realloc(!bWasInStack ? ptr : nullptr, size);
+            if (!mem) luaL_error(mL, "Out of memory");
+            if (bWasInStack && mem != ptr) memmove(mem, ptr, (std::min)(iter->mSize, size));
+
+			mStats.OnRealloc(iter->mSize, size, scope->InStack(mem));
+
+			// Replace the allocation entry. (Old stack space will be tombstoned.)
+			scope->Replace(iter, mem, size);
+
+			return mem;
+		}
+
+		//
+		else return Malloc(size);
+	}
+}
+
+void MemoryXS::ScopedSystem::Free (void * ptr)
+{
+	Scoped * scope = FindScope(ptr);	// n.b. may be an outer scope, so as to pick the right deallocator
+
+	if (scope)
+	{
+		auto iter = scope->Find(ptr);
+
+		mStats.OnFree(iter->mSize);
+
+		if (scope->InStack(iter->mPtr)) scope->TryToRewind(*iter);
+		
+		else if (iter->mAligned) AlignedFree(iter->mPtr);
+
+		else free(iter->mPtr);
+
+		scope->Remove(iter);
+	}
+}
+
+MemoryXS::Scoped * MemoryXS::ScopedSystem::FindScope (void * ptr)
+{
+	for (Scoped * scope = mCurrent; scope; scope = scope->mPrev)
+	{
+		if (scope->mIndices.Find(ptr)) return scope;
+	}
+
+	return nullptr;
+}
+
+size_t MemoryXS::ScopedSystem::GetSize (void * ptr)
+{
+	Scoped * scope = FindScope(ptr);
+
+	return scope ? scope->Find(ptr)->mSize : 0U;
+}
+
+void MemoryXS::ScopedSystem::Push (void * ptr, bool bRemove)
+{
+	lua_pushlstring(mL, static_cast<const char *>(ptr), GetSize(ptr));	// ..., bytes
+
+	if (bRemove) Free(ptr);
+}
+
+bool MemoryXS::Scoped::AddChunk (size_t size)
+{
+	if (size > eMaxChunkSize) return false;
+
+	size_t csize = mStack.empty() ? size_t(eStackSize) : (std::min)(2U * mStack.back().size(), size_t(eMaxChunkSize));
+	auto & cache = mSystem.mStacks;
+
+	try {
+		std::vector<unsigned char> chunk;
+
+		// Take the smallest cached chunk that keeps up the geometric growth, else make a new one.
+		size_t want = (std::max)(csize, size);
+		auto iter = std::lower_bound(cache.begin(), cache.end(), want, [](const std::vector<unsigned char> & cached, size_t n) {
+			return cached.size() < n;
+		});
+
+		if (iter != cache.end())
+		{
+			chunk.swap(*iter);
+
+			cache.erase(iter);
+		}
+
+		else chunk.resize(want);
+
+		mStack.push_back(std::move(chunk));
+	} catch (std::bad_alloc &) {
+		return false;
+	}
+
+	mPos = mStack.back().data();
+
+	return true;
+}
+
+bool MemoryXS::Scoped::InStack (void * ptr) const
+{
 	unsigned char * uc = static_cast<unsigned char *>(ptr);
-	
-    return uc >= stack && uc < stack + eStackSize;
+
+	for (auto & chunk : mStack)
+	{
+		if (uc >= chunk.data() && uc < chunk.data() + chunk.size()) return true;
+	}
+
+	return false;
 }
 
-void * MemoryXS::Scoped::AddToStack (size_t size)
+void * MemoryXS::Scoped::AddToStack (size_t size, size_t align)
 {
-    size_t space = size_t(mStack.data() + eStackSize - mPos);
-	void * ptr = mPos, * aligned = Align(8U, size, ptr, &space);
+	if (size == 0U) size = 1U;	// Keep every pointer distinct, so that it has its own entry
+
+	if (!mStack.empty())
+	{
+		auto & chunk = mStack.back();
+		size_t space = size_t(chunk.data() + chunk.size() - mPos);
+		void * ptr = mPos, * aligned = Align(align, size, ptr, &space);
+
+		if (aligned)
+		{
+			mPos = PointPast(ptr, size);
+
+			return aligned;
+		}
+	}
 
-    if (aligned) mPos = PointPast(ptr, size);
+	size_t need = size + align - 1U;
 
-	return aligned;
+	return need >= size && AddChunk(need) ? AddToStack(size, align) : nullptr;	// n.b. a new chunk has room for the size at any alignment
 }
 
 unsigned char * MemoryXS::Scoped::PointPast (void * ptr, size_t size) const
@@ -443,93 +1032,187 @@ unsigned char * MemoryXS::Scoped::PointPast (void * ptr, size_t size) const
 
 std::vector<MemoryXS::Scoped::Item>::iterator MemoryXS::Scoped::Find (void * ptr)
 {
-	if (!ptr) return mAllocs.end();
+	size_t * index = mIndices.Find(ptr);
 
-	return std::find_if(mAllocs.begin(), mAllocs.end(), [ptr](const Item & item) { return item.mPtr == ptr; });
+	return index ? mAllocs.begin() + *index : mAllocs.end();
 }
 
-void MemoryXS::Scoped::TryToRewind (const MemoryXS::Scoped::Item & item)
+void MemoryXS::Scoped::Add (void * ptr, size_t size, bool bAligned)
 {
-	if (mPos == PointPast(item.mPtr, item.mSize)) mPos = static_cast<unsigned char *>(item.mPtr);
+	if (!mIndices.Insert(ptr, mAllocs.size())) return;
+
+	mAllocs.push_back(Item{ptr, size, bAligned});
 }
 
-MemoryXS::Scoped::Scoped (MemoryXS::ScopedSystem & system) : mSystem{system}, mPrev{system.mCurrent}, mAllocs(), mStack()
+void MemoryXS::Scoped::Remove (std::vector<Item>::iterator iter)
 {
-	system.mCurrent = this;
+	mIndices.Erase(iter->mPtr);
 
-	if (system.mStacks.empty())
+	// Fill the hole with the last entry, rather than shifting everything after it down.
+	if (iter + 1 != mAllocs.end())
 	{
-		try {
-			mStack.resize(eStackSize);
-		} catch (std::bad_alloc &) {}
+		*iter = mAllocs.back();
+
+		*mIndices.Find(iter->mPtr) = size_t(iter - mAllocs.begin());
 	}
 
-	else
-	{
-		mStack.swap(system.mStacks.back());
+	mAllocs.pop_back();
+}
 
-		system.mStacks.pop_back();
+void MemoryXS::Scoped::Replace (std::vector<Item>::iterator iter, void * ptr, size_t size)
+{
+	if (ptr != iter->mPtr)
+	{
+		mIndices.Erase(iter->mPtr);
+		mIndices.Insert(ptr, size_t(iter - mAllocs.begin()));
 	}
 
-	if (!mStack.empty()) mPos = mStack.data();
+	iter->mPtr = ptr;
+	iter->mSize = size;
+	iter->mAligned = false;
+}
+
+void MemoryXS::Scoped::TryToRewind (const MemoryXS::Scoped::Item & item)
+{
+	unsigned char * uc = static_cast<unsigned char *>(item.mPtr);
+
+	if (uc >= mStack.back().data() && uc < mStack.back().data() + mStack.back().size() && mPos == PointPast(item.mPtr, (std::max)(item.mSize, size_t(1U)))) mPos = uc;	// Only within the current chunk; see AddToStack() for the size
+}
+
+MemoryXS::Scoped::Scoped (MemoryXS::ScopedSystem & system) : mSystem{system}, mPrev{system.mCurrent}, mAllocs(), mStack()
+{
+	system.mCurrent = this;
 }
 
 MemoryXS::Scoped::~Scoped (void)
 {
 	for (auto iter : mAllocs)
 	{
-		if (!InStack(iter.mPtr)) free(iter.mPtr);
+		mSystem.mStats.OnFree(iter.mSize);
+
+		if (InStack(iter.mPtr)) continue;
+
+		if (iter.mAligned) AlignedFree(iter.mPtr);
+
+		else free(iter.mPtr);
 	}
 
 	mSystem.mCurrent = mPrev;
 
-	if (mStack.empty()) return;
+	// Cache the chunks for later scopes, keeping the larger ones if there are too many.
+	auto & cache = mSystem.mStacks;
 
-	try {
-		mSystem.mStacks.push_back(std::move(mStack));
-	} catch (std::bad_alloc &) {}
+	for (auto & chunk : mStack)
+	{
+		auto pos = std::upper_bound(cache.begin(), cache.end(), chunk.size(), [](size_t size, const std::vector<unsigned char> & cached) {
+			return size < cached.size();
+		});
+
+		try {
+			cache.insert(pos, std::move(chunk));
+		} catch (std::bad_alloc &) {}
+	}
+
+	if (cache.size() > eMaxCachedChunks) cache.erase(cache.begin(), cache.end() - eMaxCachedChunks);
 }
 
 bool MemoryXS::ScopedList::Exists (void * ptr) const
 {
-    return ptr != nullptr && std::find(mPtrs.begin(), mPtrs.end(), ptr) != mPtrs.end();
+    return mIndices.Find(ptr) != nullptr;
+}
+
+bool MemoryXS::ScopedList::IsAligned (void * ptr) const
+{
+    const size_t * index = mIndices.Find(ptr);
+
+    return index && mAligned[*index];
 }
 
-void MemoryXS::ScopedList::Add (void * ptr)
+void MemoryXS::ScopedList::Add (void * ptr, size_t size, bool bAligned)
 {
-    auto iter = std::find(mPtrs.begin(), mPtrs.end(), nullptr);
+    if (!ptr || mIndices.Find(ptr)) return;
+
+    mIndices.Insert(ptr, mPtrs.size());
 
-    if (iter != mPtrs.end()) *iter = ptr;
-    else if (ptr) mPtrs.push_back(ptr);
+    mPtrs.push_back(ptr);
+    mSizes.push_back(size);
+    mAligned.push_back(bAligned);
 }
 
 void MemoryXS::ScopedList::Remove (void * ptr)
 {
-    auto iter = std::find(mPtrs.begin(), mPtrs.end(), ptr);
+    auto iter = Find(ptr);
+
+    if (iter == mPtrs.end()) return;
+
+    mIndices.Erase(ptr);
 
-    if (iter != mPtrs.end()) *iter = nullptr;
+    // Fill the hole with the last pointer, so the list never has gaps.
+    size_t index = size_t(iter - mPtrs.begin());
+
+    if (iter + 1 != mPtrs.end())
+    {
+        *iter = mPtrs.back();
+        mSizes[index] = mSizes.back();
+        mAligned[index] = mAligned.back();
+
+        *mIndices.Find(*iter) = index;
+    }
+
+    mPtrs.pop_back();
+    mSizes.pop_back();
+    mAligned.pop_back();
 }
 
 void MemoryXS::ScopedList::RemoveAll (void)
 {
     mPtrs.clear();
+    mSizes.clear();
+    mAligned.clear();
+    mIndices.Clear();
+}
+
+void MemoryXS::ScopedList::Replace (std::vector<void *>::iterator iter, void * ptr, size_t size)
+{
+    size_t index = size_t(iter - mPtrs.begin());
+
+    mIndices.Erase(*iter);
+    mIndices.Insert(ptr, index);
+
+    *iter = ptr;
+    mSizes[index] = size;
+    mAligned[index] = false;
+}
+
+size_t MemoryXS::ScopedList::GetSize (void * ptr) const
+{
+    const size_t * index = mIndices.Find(ptr);
+
+    return index ? mSizes[*index] : 0U;
 }
 
 std::vector<void *>::iterator MemoryXS::ScopedList::Find (void * ptr)
 {
-    if (!ptr) return mPtrs.end();
+    size_t * index = mIndices.Find(ptr);
 
-    return std::find(mPtrs.begin(), mPtrs.end(), ptr);
+    return index ? mPtrs.begin() + *index : mPtrs.end();
 }
 
-MemoryXS::ScopedList::ScopedList (MemoryXS::ScopedListSystem & system) : mSystem{system}, mPrev{system.mCurrent}, mPtrs()
+MemoryXS::ScopedList::ScopedList (MemoryXS::ScopedListSystem & system) : mSystem{system}, mPrev{system.mCurrent}, mPtrs(), mSizes(), mAligned()
 {
     system.mCurrent = this;
 }
 
 MemoryXS::ScopedList::~ScopedList (void)
 {
-    for (auto iter : mPtrs) free(iter);
+    for (size_t i = 0; i < mPtrs.size(); ++i)
+    {
+        mSystem.mStats.OnFree(mSizes[i]);
+
+        if (mAligned[i]) AlignedFree(mPtrs[i]);
+
+        else free(mPtrs[i]);
+    }
     
     mSystem.mCurrent = mPrev;
 }
@@ -556,7 +1239,23 @@ void * MemoryXS::ScopedListSystem::Malloc (size_t size)
 {
     void * ptr = malloc(size);
 
-    mCurrent->Add(ptr);
+    mCurrent->Add(ptr, size);
+
+    if (ptr) mStats.OnAlloc(size, false);
+
+    return ptr;
+}
+
+void * MemoryXS::ScopedListSystem::MallocAligned (size_t size, size_t align)
+{
+    if (!IsValidAlignment(align)) return nullptr;
+    if (align <= eMinAlignment) return Malloc(size);
+
+    void * ptr = AlignedMalloc(size, align);
+
+    mCurrent->Add(ptr, size, true);
+
+    if (ptr) mStats.OnAlloc(size, false);
 
     return ptr;
 }
@@ -565,29 +1264,885 @@ void * MemoryXS::ScopedListSystem::Calloc (size_t num, size_t size)
 {
     void * ptr = calloc(num, size);
 
-    mCurrent->Add(ptr);
+    mCurrent->Add(ptr, num * size);
+
+    if (ptr) mStats.OnAlloc(num * size, false);
 
     return ptr;
 }
 
 void * MemoryXS::ScopedListSystem::Realloc (void * ptr, size_t size)
 {
-    void * mem = realloc(ptr, size);
+    if (size == 0U)
+    {
+        Free(ptr);
 
-    if (size == 0U) mem = nullptr;
-    
-    if (mem != ptr)
+        return nullptr;
+    }
+
+    ScopedList * list = FindList(ptr);
+    auto iter = list ? list->Find(ptr) : mCurrent->mPtrs.end();
+    size_t old_size = list ? list->GetSize(ptr) : 0U;
+    bool bAligned = list && list->IsAligned(ptr);
+    void * mem = bAligned ? malloc(size) : realloc(ptr, size);  // realloc() cannot take aligned blocks, so move these into ordinary ones
+
+    if (!mem) return nullptr;
+
+    if (bAligned)
     {
-        mCurrent->Remove(ptr);
-        mCurrent->Add(mem);
+        memcpy(mem, ptr, (std::min)(old_size, size));
+
+        AlignedFree(ptr);
     }
 
+    if (list) list->Replace(iter, mem, size);
+    else mCurrent->Add(mem, size);
+
+    mStats.OnRealloc(old_size, size, false);
+
     return mem;
 }
 
 void MemoryXS::ScopedListSystem::Free (void * ptr)
 {
-    if (mCurrent) mCurrent->Remove(ptr);
+    ScopedList * list = FindList(ptr);  // n.b. may be an outer list, so as to pick the right deallocator
+    bool bAligned = false;
+
+    if (list)
+    {
+        bAligned = list->IsAligned(ptr);
+
+        mStats.OnFree(list->GetSize(ptr));
+
+        list->Remove(ptr);
+    }
+
+    if (bAligned) AlignedFree(ptr);
+
+    else free(ptr);
+}
+
+MemoryXS::ScopedList * MemoryXS::ScopedListSystem::FindList (void * ptr)
+{
+    for (ScopedList * list = ptr ? mCurrent : nullptr; list; list = list->mPrev)
+    {
+        if (list->Exists(ptr)) return list;
+    }
+
+    return nullptr;
+}
+
+size_t MemoryXS::ScopedListSystem::GetSize (void * ptr)
+{
+    ScopedList * list = FindList(ptr);
+
+    return list ? list->GetSize(ptr) : 0U;
+}
+
+struct MemoryXS::PoolSystem::Cache {
+	void * mBlocks[eClassCount][eCacheSize];// Free blocks, per size class
+	size_t mCounts[eClassCount];// Number of blocks, per size class
+	std::shared_ptr<const std::atomic<bool>> mOwnerExited;	// Set once the owning thread is gone
+};
+
+// Every block is preceded by a header, so that frees and size queries know where it came from.
+struct MemoryXS::PoolSystem::Header {
+	size_t mSize;	// Requested size
+	size_t mIndex;	// Size class; eClassCount if the block came from malloc(), or more for aligned memory (see MallocAligned())
+
+	static Header * Get (void * ptr)
+	{
+		return reinterpret_cast<Header *>(static_cast<unsigned char *>(ptr) - eHeaderSize);
+	}
+};
+
+static_assert(sizeof(MemoryXS::PoolSystem::Header) <= MemoryXS::PoolSystem::eHeaderSize, "Pool header too large");
+
+MemoryXS::PoolSystem * MemoryXS::PoolSystem::New (lua_State * L)
+{
+	PoolSystem * system = LuaXS::NewTyped<PoolSystem>(L);	// ..., system
+
+	LuaXS::AttachGC(L, LuaXS::TypedGC<PoolSystem>);
 
-    free(ptr);
+	system->mL = L;
+
+	lua_pushlightuserdata(L, system);	// ..., system, system_ptr
+	lua_insert(L, -2);	// ..., system_ptr, system
+	lua_rawset(L, LUA_REGISTRYINDEX);	// ...; registry = { ..., [system_ptr] = system }
+
+	return system;
+}
+
+MemoryXS::PoolSystem::PoolSystem (void)
+{
+	for (auto & head : mFree) head = nullptr;
+}
+
+MemoryXS::PoolSystem::~PoolSystem (void)
+{
+	for (void * slab : mSlabs) free(slab);
+}
+
+void * MemoryXS::PoolSystem::Allocate (size_t size)
+{
+	int index = GetClass(size);
+	Header * header;
+
+	if (index >= 0)
+	{
+		Cache * cache = GetCache();
+
+		if (!cache) return nullptr;
+		if (!cache->mCounts[index]) Refill(cache, index);
+		if (!cache->mCounts[index]) return nullptr;
+
+		header = static_cast<Header *>(cache->mBlocks[index][--cache->mCounts[index]]);
+		header->mIndex = size_t(index);
+	}
+
+	else
+	{
+		header = static_cast<Header *>(malloc(eHeaderSize + size));
+
+		if (!header) return nullptr;
+
+		header->mIndex = eClassCount;
+	}
+
+	header->mSize = size;
+
+	return reinterpret_cast<unsigned char *>(header) + eHeaderSize;
+}
+
+MemoryXS::PoolSystem::Cache * MemoryXS::PoolSystem::GetCache (void)
+{
+	Cache * cache = mCache;
+
+	if (!cache)
+	{
+		std::shared_ptr<const std::atomic<bool>> exited;
+
+		try {
+			exited = ThreadXS::GetExitFlag();
+		} catch (std::bad_alloc &) {
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock{mMutex};
+
+		// Take over the cache of a thread that has exited, blocks and all, if there is one.
+		for (auto & other : mCaches)
+		{
+			if (*other->mOwnerExited)
+			{
+				cache = other.get();
+
+				break;
+			}
+		}
+
+		if (!cache)
+		{
+			try {
+				mCaches.emplace_back(new Cache);
+			} catch (std::bad_alloc &) {
+				return nullptr;
+			}
+
+			cache = mCaches.back().get();
+
+			for (auto & count : cache->mCounts) count = 0U;
+		}
+
+		cache->mOwnerExited = std::move(exited);
+
+		mCache = cache;
+	}
+
+	return cache;
+}
+
+void * MemoryXS::PoolSystem::NewBlock (int index)
+{
+	if (mFree[index])
+	{
+		void * block = mFree[index];
+
+		mFree[index] = *static_cast<void **>(block);
+
+		return block;
+	}
+
+	size_t block_size = GetBlockSize(index);
+
+	if (size_t(mEnd - mPos) < block_size)
+	{
+		void * slab = malloc(eSlabSize);
+
+		if (!slab) return nullptr;
+
+		try {
+			mSlabs.push_back(slab);
+		} catch (std::bad_alloc &) {
+			free(slab);
+
+			return nullptr;
+		}
+
+		mPos = static_cast<unsigned char *>(slab);
+		mEnd = mPos + eSlabSize;
+	}
+
+	void * block = mPos;
+
+	mPos += block_size;
+
+	return block;
+}
+
+void MemoryXS::PoolSystem::Release (void * ptr)
+{
+	Header * header = Header::Get(ptr);
+
+	if (header->mIndex > eClassCount) Release(static_cast<unsigned char *>(ptr) - (header->mIndex - eClassCount));
+
+	else if (header->mIndex == eClassCount) free(header);
+
+	else
+	{
+		Cache * cache = GetCache();
+		int index = int(header->mIndex);
+
+		if (!cache)	// Unable to make a cache, so go straight to the shared list
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			*reinterpret_cast<void **>(header) = mFree[index];
+
+			mFree[index] = header;
+		}
+
+		else
+		{
+			if (cache->mCounts[index] == eCacheSize) Spill(cache, index);
+
+			cache->mBlocks[index][cache->mCounts[index]++] = header;
+		}
+	}
+}
+
+void MemoryXS::PoolSystem::Refill (Cache * cache, int index)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	for (size_t & count = cache->mCounts[index]; count < eCacheSize / 2; ++count)
+	{
+		void * block = NewBlock(index);
+
+		if (!block) break;
+
+		cache->mBlocks[index][count] = block;
+	}
+}
+
+void MemoryXS::PoolSystem::Spill (Cache * cache, int index)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	for (size_t & count = cache->mCounts[index]; count > eCacheSize / 2; --count)
+	{
+		void * block = cache->mBlocks[index][count - 1];
+
+		*static_cast<void **>(block) = mFree[index];
+
+		mFree[index] = block;
+	}
+}
+
+void MemoryXS::PoolSystem::FailAssert (const char * what)
+{
+	luaL_error(mL, what);
+}
+
+void * MemoryXS::PoolSystem::Malloc (size_t size)
+{
+	void * ptr = Allocate(size);
+
+	if (ptr) mStats.OnAlloc(size, GetClass(size) >= 0);
+
+	return ptr;
+}
+
+void * MemoryXS::PoolSystem::MallocAligned (size_t size, size_t align)
+{
+	if (!IsValidAlignment(align)) return nullptr;
+	if (align <= eMinAlignment) return Malloc(size);
+
+	size_t extra = eHeaderSize + align - 1U;
+
+	if (size > size_t(-1) - extra) return nullptr;
+
+	void * block = Allocate(size + extra);
+
+	if (!block) return nullptr;
+
+	// Put a second header ahead of the aligned memory, whose class encodes the offset back to the block.
+	void * ptr = static_cast<unsigned char *>(block) + eHeaderSize;
+
+	Align(align, size, ptr);
+
+	Header * header = Header::Get(ptr);
+
+	header->mSize = size;
+	header->mIndex = eClassCount + size_t(static_cast<unsigned char *>(ptr) - static_cast<unsigned char *>(block));
+
+	mStats.OnAlloc(size, GetClass(size + extra) >= 0);
+
+	return ptr;
+}
+
+void * MemoryXS::PoolSystem::Calloc (size_t num, size_t size)
+{
+	if (size && num > size_t(-1) / size) return nullptr;
+
+	void * ptr = Malloc(num * size);
+
+	if (ptr) memset(ptr, 0, num * size);
+
+	return ptr;
+}
+
+void * MemoryXS::PoolSystem::Realloc (void * ptr, size_t size)
+{
+	if (size == 0U)
+	{
+		Free(ptr);
+
+		return nullptr;
+	}
+
+	else if (!ptr) return Malloc(size);
+
+	Header * header = Header::Get(ptr);
+	size_t old_size = header->mSize;
+	int index = GetClass(size);
+	void * mem;
+
+	if (index >= 0 && size_t(index) == header->mIndex)
+	{
+		header->mSize = size;
+
+		mem = ptr;
+	}
+
+	else if (index < 0 && header->mIndex == eClassCount)
+	{
+		header = static_cast<Header *>(realloc(header, eHeaderSize + size));
+
+		if (!header) return nullptr;
+
+		header->mSize = size;
+
+		mem = reinterpret_cast<unsigned char *>(header) + eHeaderSize;
+	}
+
+	else
+	{
+		mem = Allocate(size);
+
+		if (!mem) return nullptr;
+
+		memcpy(mem, ptr, (std::min)(old_size, size));
+
+		Release(ptr);
+	}
+
+	mStats.OnRealloc(old_size, size, index >= 0);
+
+	return mem;
+}
+
+void MemoryXS::PoolSystem::Free (void * ptr)
+{
+	if (!ptr) return;
+
+	mStats.OnFree(Header::Get(ptr)->mSize);
+
+	Release(ptr);
+}
+
+size_t MemoryXS::PoolSystem::GetSize (void * ptr)
+{
+	return ptr ? Header::Get(ptr)->mSize : 0U;
+}
+
+void MemoryXS::PoolSystem::Push (void * ptr, bool bRemove)
+{
+	lua_pushlstring(mL, static_cast<const char *>(ptr), GetSize(ptr));	// ..., bytes
+
+	if (bRemove) Free(ptr);
+}
+
+MemoryXS::PageSystem * MemoryXS::PageSystem::New (lua_State * L)
+{
+	PageSystem * system = LuaXS::NewTyped<PageSystem>(L);	// ..., system
+
+	LuaXS::AttachGC(L, LuaXS::TypedGC<PageSystem>);
+
+	system->mL = L;
+
+	lua_pushlightuserdata(L, system);	// ..., system, system_ptr
+	lua_insert(L, -2);	// ..., system_ptr, system
+	lua_rawset(L, LUA_REGISTRYINDEX);	// ...; registry = { ..., [system_ptr] = system }
+
+	return system;
+}
+
+size_t MemoryXS::PageSystem::GetPageSize (void)
+{
+	static const size_t sPageSize = []() -> size_t {	// n.b. initialized once, even with several threads calling
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+
+		GetSystemInfo(&info);
+
+		return size_t(info.dwPageSize);
+	#else
+		long size = sysconf(_SC_PAGESIZE);
+
+		return size > 0 ? size_t(size) : 4096U;
+	#endif
+	}();
+
+	return sPageSize;
+}
+
+MemoryXS::PageSystem::~PageSystem (void)
+{
+	for (auto & mapping : mLive) Unmap(mapping.mPtr, mapping.mLength);
+	for (auto & mapping : mCache) Unmap(mapping.mPtr, mapping.mLength);
+}
+
+void * MemoryXS::PageSystem::Map (size_t length, bool bPopulate, bool bHuge)
+{
+#ifdef _WIN32
+	void * ptr = VirtualAlloc(nullptr, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+	if (ptr && bPopulate) Populate(ptr, length);
+
+	return ptr;
+#else
+	int flags = MAP_PRIVATE | MAP_ANON;
+	size_t extra = bHuge ? size_t(eHugePageSize) : 0U;	// Over-map huge mappings, so they can be trimmed to a huge page boundary
+
+	#ifdef MAP_POPULATE
+		if (bPopulate && !extra)
+		{
+			flags |= MAP_POPULATE;
+
+			bPopulate = false;
+		}
+	#endif
+
+	if (length > size_t(-1) - extra) return nullptr;
+
+	void * mem = mmap(nullptr, length + extra, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+	if (mem == MAP_FAILED) return nullptr;
+
+	unsigned char * ptr = static_cast<unsigned char *>(mem);
+
+	if (extra)
+	{
+		unsigned char * aligned = reinterpret_cast<unsigned char *>((uintptr_t(ptr) + extra - 1U) & ~uintptr_t(extra - 1U));
+
+		if (aligned != ptr) munmap(ptr, size_t(aligned - ptr));
+		if (aligned != ptr + extra) munmap(aligned + length, size_t(ptr + extra - aligned));
+
+		ptr = aligned;
+
+	#ifdef HAS_HUGE_PAGE_HINTS
+		madvise(ptr, length, MADV_HUGEPAGE);
+	#endif
+	}
+
+	if (bPopulate) Populate(ptr, length);
+
+	return ptr;
+#endif
+}
+
+void MemoryXS::PageSystem::Unmap (void * ptr, size_t length)
+{
+#ifdef _WIN32
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, length);
+#endif
+}
+
+void MemoryXS::PageSystem::Discard (void * ptr, size_t length)
+{
+#ifdef _WIN32
+	VirtualAlloc(ptr, length, MEM_RESET, PAGE_READWRITE);
+#elif defined(__APPLE__) && defined(MADV_FREE)
+	madvise(ptr, length, MADV_FREE);// MADV_DONTNEED is only advisory here
+#else
+	madvise(ptr, length, MADV_DONTNEED);// On Linux, anonymous pages come back zeroed on the next touch
+#endif
+}
+
+void MemoryXS::PageSystem::Populate (void * ptr, size_t length)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(ptr, length, MADV_POPULATE_WRITE) == 0) return;
+#endif
+
+	// Otherwise, touch each page; these are either fresh or discarded, so the contents do not matter.
+	volatile unsigned char * bytes = static_cast<unsigned char *>(ptr);
+
+	for (size_t i = 0, page_size = GetPageSize(); i < length; i += page_size) bytes[i] = 0;
+}
+
+void * MemoryXS::PageSystem::Remap (void * ptr, size_t old_length, size_t new_length)
+{
+#if !defined(_WIN32) && defined(MREMAP_MAYMOVE)
+	void * mem = mremap(ptr, old_length, new_length, MREMAP_MAYMOVE);	// Grows in place if it can, else moves the pages without copying
+
+	return mem != MAP_FAILED ? mem : nullptr;
+#else
+	return nullptr;
+#endif
+}
+
+void * MemoryXS::PageSystem::Allocate (size_t size, bool & bReused)
+{
+	bool bHuge = WantsHugePages(size);
+	size_t length = GetLength(size, bHuge);
+
+	if (!length) return nullptr;
+
+	Mapping mapping{nullptr, size, 0U};
+
+	{
+		std::lock_guard<std::mutex> lock{mMutex};
+
+		// Reuse the smallest cached mapping that fits, unless most of it would go to waste.
+		auto iter = std::lower_bound(mCache.begin(), mCache.end(), length, [](const Mapping & cached, size_t len) {
+			return cached.mLength < len;
+		});
+
+		if (iter != mCache.end() && iter->mLength / 2U <= length)
+		{
+			mapping.mPtr = iter->mPtr;
+			mapping.mLength = iter->mLength;
+			mCachedBytes -= iter->mLength;
+
+			mCache.erase(iter);
+		}
+	}
+
+	bReused = mapping.mPtr != nullptr;
+
+	if (!bReused)
+	{
+		mapping.mPtr = Map(length, mPopulate, bHuge);
+		mapping.mLength = length;
+
+		if (!mapping.mPtr) return nullptr;
+	}
+
+	else if (mPopulate) Populate(mapping.mPtr, length);
+
+	if (!Track(mapping))
+	{
+		Release(mapping);
+
+		return nullptr;
+	}
+
+	return mapping.mPtr;
+}
+
+size_t MemoryXS::PageSystem::GetLength (size_t size, bool bHuge) const	// 0 on overflow
+{
+	size_t unit = bHuge ? size_t(eHugePageSize) : GetPageSize();
+
+	if (size > size_t(-1) - unit) return 0U;
+
+	return (size + unit - 1U) & ~(unit - 1U);
+}
+
+void MemoryXS::PageSystem::Release (const Mapping & mapping)
+{
+	if (mapping.mLength > mMaxCachedBytes)
+	{
+		Unmap(mapping.mPtr, mapping.mLength);
+
+		return;
+	}
+
+	Discard(mapping.mPtr, mapping.mLength);
+
+	std::vector<Mapping> evicted;
+
+	{
+		std::lock_guard<std::mutex> lock{mMutex};
+
+		auto pos = std::upper_bound(mCache.begin(), mCache.end(), mapping.mLength, [](size_t len, const Mapping & cached) {
+			return len < cached.mLength;
+		});
+
+		try {
+			mCache.insert(pos, mapping);
+
+			mCachedBytes += mapping.mLength;
+		} catch (std::bad_alloc &) {
+			Unmap(mapping.mPtr, mapping.mLength);	// n.b. not via evicted, whose growth could throw too
+		}
+
+		// Keep the larger mappings if the cache is over its limits.
+		size_t count = 0U;
+
+		while (count < mCache.size() && (mCache.size() - count > eMaxCachedMappings || mCachedBytes > mMaxCachedBytes)) mCachedBytes -= mCache[count++].mLength;
+
+		if (count)
+		{
+			evicted.insert(evicted.end(), mCache.begin(), mCache.begin() + count);
+
+			mCache.erase(mCache.begin(), mCache.begin() + count);
+		}
+	}
+
+	for (auto & old : evicted) Unmap(old.mPtr, old.mLength);
+}
+
+bool MemoryXS::PageSystem::Track (const Mapping & mapping)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	try {
+		mLive.push_back(mapping);
+	} catch (std::bad_alloc &) {
+		return false;
+	}
+
+	bool bInserted;
+
+	try {
+		bInserted = mIndices.Insert(mapping.mPtr, mLive.size() - 1U);
+	} catch (std::bad_alloc &) {
+		bInserted = false;
+	}
+
+	if (!bInserted) mLive.pop_back();
+
+	return bInserted;
+}
+
+bool MemoryXS::PageSystem::Lookup (void * ptr, Mapping & mapping)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	size_t * index = mIndices.Find(ptr);
+
+	if (index) mapping = mLive[*index];
+
+	return index != nullptr;
+}
+
+bool MemoryXS::PageSystem::Retrack (void * ptr, Mapping & mapping, size_t length)
+{
+	std::lock_guard<std::mutex> lock{mMutex};	// n.b. held across any remap, so no other thread can track a reuse of ptr's old pages first
+
+	size_t * index = mIndices.Find(ptr);
+
+	if (!index) return false;
+
+	if (length != mapping.mLength)
+	{
+		void * mem = Remap(ptr, mapping.mLength, length);
+
+		if (!mem) return false;
+
+		mapping.mPtr = mem;
+		mapping.mLength = length;
+	}
+
+	size_t pos = *index;
+
+	// Swap the keys in place. Insert() cannot grow the map, and thus throw, with a key just erased.
+	if (mapping.mPtr != ptr)
+	{
+		mIndices.Erase(ptr);
+		mIndices.Insert(mapping.mPtr, pos);
+	}
+
+	mLive[pos] = mapping;
+
+	return true;
+}
+
+bool MemoryXS::PageSystem::Untrack (void * ptr, Mapping & mapping)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	size_t * index = mIndices.Find(ptr);
+
+	if (!index) return false;
+
+	size_t pos = *index;
+
+	mapping = mLive[pos];
+
+	mIndices.Erase(ptr);
+
+	// Fill the hole with the last mapping, rather than shifting everything after it down.
+	if (pos + 1U != mLive.size())
+	{
+		mLive[pos] = mLive.back();
+
+		*mIndices.Find(mLive[pos].mPtr) = pos;
+	}
+
+	mLive.pop_back();
+
+	return true;
+}
+
+bool MemoryXS::PageSystem::WantsHugePages (size_t size) const
+{
+#ifdef HAS_HUGE_PAGE_HINTS
+	return mHugePages && size >= eHugePageSize;
+#else
+	return false;
+#endif
+}
+
+void MemoryXS::PageSystem::FailAssert (const char * what)
+{
+	luaL_error(mL, what);
+}
+
+void * MemoryXS::PageSystem::Malloc (size_t size)
+{
+	bool bReused;
+	void * ptr = size ? Allocate(size, bReused) : nullptr;
+
+	if (ptr) mStats.OnAlloc(size, bReused);
+
+	return ptr;
+}
+
+void * MemoryXS::PageSystem::MallocAligned (size_t size, size_t align)
+{
+	if (!IsValidAlignment(align) || align > GetPageSize()) return nullptr;
+
+	return Malloc(size);// Mappings are page-aligned
+}
+
+void * MemoryXS::PageSystem::Calloc (size_t num, size_t size)
+{
+	if (size && num > size_t(-1) / size) return nullptr;
+
+	size_t total = num * size;
+	bool bReused;
+	void * ptr = total ? Allocate(total, bReused) : nullptr;
+
+	if (!ptr) return nullptr;
+
+	mStats.OnAlloc(total, bReused);
+
+#ifndef __linux__
+	if (bReused) memset(ptr, 0, total);	// Fresh pages are zeroed everywhere, but discarded ones only on Linux
+#endif
+
+	return ptr;
+}
+
+void * MemoryXS::PageSystem::Realloc (void * ptr, size_t size)
+{
+	if (size == 0U)
+	{
+		Free(ptr);
+
+		return nullptr;
+	}
+
+	else if (!ptr) return Malloc(size);
+
+	Mapping mapping;
+
+	if (!Lookup(ptr, mapping)) return nullptr;
+
+	size_t old_size = mapping.mSize, old_length = mapping.mLength;
+	bool bHuge = WantsHugePages(size);
+	size_t length = GetLength(size, bHuge), used_length = GetLength(old_size, WantsHugePages(old_size));
+
+	mapping.mSize = size;
+
+	// Shrink or grow within the mapping, releasing any pages that fall out of use.
+	if (length && length <= old_length)
+	{
+		if (length < used_length) Discard(static_cast<unsigned char *>(ptr) + length, used_length - length);
+
+		if (!Retrack(ptr, mapping, old_length)) return nullptr;
+	}
+
+	// Otherwise, try to extend the mapping, in place or by moving its pages. The entry stays
+	// tracked throughout, and is updated under the same lock as the remap.
+	else if (length && Retrack(ptr, mapping, length))
+	{
+	#ifdef HAS_HUGE_PAGE_HINTS
+		if (bHuge) madvise(mapping.mPtr, length, MADV_HUGEPAGE);
+	#endif
+	}
+
+	// Failing that, copy into a new mapping.
+	else
+	{
+		bool bReused;
+		void * copy = length ? Allocate(size, bReused) : nullptr;
+
+		if (!copy) return nullptr;	// n.b. ptr is still tracked
+
+		memcpy(copy, ptr, (std::min)(old_size, size));
+
+		if (Untrack(ptr, mapping)) Release(mapping);
+
+		mStats.OnRealloc(old_size, size, false);
+
+		return copy;
+	}
+
+	mStats.OnRealloc(old_size, size, true);
+
+	return mapping.mPtr;
+}
+
+void MemoryXS::PageSystem::Free (void * ptr)
+{
+	Mapping mapping;
+
+	if (!ptr || !Untrack(ptr, mapping)) return;
+
+	mStats.OnFree(mapping.mSize);
+
+	Release(mapping);
+}
+
+size_t MemoryXS::PageSystem::GetSize (void * ptr)
+{
+	std::lock_guard<std::mutex> lock{mMutex};
+
+	size_t * index = ptr ? mIndices.Find(ptr) : nullptr;
+
+	return index ? mLive[*index].mSize : 0U;
+}
+
+void MemoryXS::PageSystem::Push (void * ptr, bool bRemove)
+{
+	lua_pushlstring(mL, static_cast<const char *>(ptr), GetSize(ptr));	// ..., bytes
+
+	if (bRemove) Free(ptr);
 }
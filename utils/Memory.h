@@ -25,17 +25,64 @@
 
 #include "CoronaLua.h"
 #include "utils/Namespace.h"
+#include "utils/Thread.h"
 #include "external/aligned_allocator.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <vector>
 
 //
 CEU_BEGIN_NAMESPACE(MemoryXS) {
+	// Allocation counters, kept by each system once enabled. Hits are requests served by the
+	// system's fast path, i.e. a scope's stack, a slab, or a pool size class; misses fell back
+	// to the general heap or a dedicated userdata. Memory reclaimed by Lua's GC, rather than
+	// freed, is not subtracted from the live count.
+	struct Stats {
+		enum { eBucketCount = 16 };	// Histogram buckets: up to 16 bytes, up to 32, ..., up to 256 KB, and larger
+
+		std::atomic<bool> mEnabled{false};	// Gathering counts?
+		std::atomic<uint64_t> mLive{0U};// Bytes currently allocated
+		std::atomic<uint64_t> mPeak{0U};// High-water mark of live bytes
+		std::atomic<uint64_t> mAllocs{0U};	// Number of allocations...
+		std::atomic<uint64_t> mFrees{0U};	// ...frees...
+		std::atomic<uint64_t> mReallocs{0U};// ...and reallocations
+		std::atomic<uint64_t> mHits{0U};// Requests served by fast path
+		std::atomic<uint64_t> mMisses{0U};	// Requests that fell back
+		std::atomic<uint64_t> mHistogram[eBucketCount];	// Request sizes
+
+		Stats (void);
+
+		bool IsEnabled (void) const { return mEnabled.load(std::memory_order_relaxed); }
+
+		void AddRequest (size_t size, bool bHit);
+		void OnAlloc (size_t size, bool bHit);
+		void OnFree (size_t size);
+		void OnRealloc (size_t old_size, size_t size, bool bHit);
+		void Push (lua_State * L, bool bReset = false);	// Push table of counts, optionally resetting them
+		void Reset (void);	// Live bytes are kept, and become the peak
+	};
+
+	// Power-of-2 size classes shared by the slab allocators, i.e. LuaMemory in slab mode and
+	// PoolSystem. Each block begins with a header, and blocks are carved out of larger slabs.
+	struct SizeClasses {
+		enum { eHeaderSize = 16, eMinShift = 5, eMaxShift = 12, eClassCount = eMaxShift - eMinShift + 1, eSlabSize = 64 * 1024 };
+
+		static int GetClass (size_t size);	// -1 if too large for a slab
+		static size_t GetBlockSize (int index) { return size_t(1U) << (index + eMinShift); }
+	};
+
 	//
 	struct LuaMemory {
 		lua_State * mL{nullptr};// Main Lua state for this 
 		int mIndex{0};	// Index of memory
 		int mRegistrySlot{LUA_NOREF};	// Slot in registry, if used
 		int mStoreSlot{LUA_NOREF};	// Slot in registry for table storage, if used
+		bool mSlabs{false};	// Carve small allocations out of slabs?
+		Stats mStats;	// Allocation counts
+
+		struct SlabState;
 
 		struct BookmarkDualTables {
 			LuaMemory * mOwner;	// Memory TLS to repair
@@ -58,6 +105,10 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 		size_t GetOldSize (int slot, void * ptr);
 
 		void * Add (int slot, size_t size);
+		void * AddAligned (int slot, size_t size, size_t align, size_t prefix);
+		void * AddWithHeader (int slot, size_t size);
+		void FreeWithHeader (void * ptr);
+		SlabState * GetSlabState (int slot);
 
 		int Begin (void);
 
@@ -66,6 +117,7 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 		void PrepDualTables (void);
 		void PrepMemory (int slot = 0);
 		void PrepRegistry (void);
+		void PrepSlabs (void);
 		void PushObject (int slot, void * ptr);
 		void Remove (int slot, void * ptr);
 		void UnloadTable (void);
@@ -73,6 +125,7 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 		// Interface
 		void FailAssert (const char * what);
 		void * Malloc (size_t size);
+		void * MallocAligned (size_t size, size_t align);
 		void * Calloc (size_t num, size_t size);
 		void * Realloc (void * ptr, size_t size);
 		void Free (void * ptr);
@@ -97,6 +150,17 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 
 	void * Align (size_t bound, size_t size, void *& ptr, size_t * space = nullptr);
 
+	// Alignment that every system below provides by default; MallocAligned() handles stricter
+	// requests, e.g. 16-, 32-, or 64-byte alignment for SIMD buffers. As with C's realloc(), a
+	// block that Realloc() has to move only keeps the default alignment.
+	enum { eMinAlignment = 8 };
+
+	inline bool IsValidAlignment (size_t align) { return align && !(align & (align - 1U)); }
+
+	// Heap memory with arbitrary power-of-2 alignment; must be released with AlignedFree()
+	void * AlignedMalloc (size_t size, size_t align);
+	void AlignedFree (void * ptr);
+
 	// Adapted from https://raw.githubusercontent.com/evgeny-panasyuk/cps_alloca/master/core_idea.cpp
 
 	template<typename T, unsigned N, typename F>
@@ -129,6 +193,29 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 		}; // mpl::for_each / array / index pack / recursive bsearch / etc variacion
 	}
 
+	// Open-addressing map from pointers to indices, giving constant-time allocation bookkeeping
+	class PointerMap {
+		struct Entry {
+			void * mPtr;// Key; null if the entry is empty
+			size_t mValue;	// Associated value
+		};
+
+		std::vector<Entry> mEntries;// Entries, with linear probing; a power-of-2 count
+		size_t mCount{0U};	// Number of keys
+
+		size_t Home (void * ptr) const;
+		size_t Slot (void * ptr) const;
+		void Grow (void);
+
+	public:
+		size_t * Find (void * ptr);
+		const size_t * Find (void * ptr) const;
+		bool Insert (void * ptr, size_t value);	// false, leaving the map unchanged, if ptr is null or already present
+		bool Erase (void * ptr);
+		void Clear (void);
+		size_t GetCount (void) const { return mCount; }
+	};
+
 	//
 	struct ScopedSystem;
 
@@ -137,21 +224,28 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 		struct Item {
 			void * mPtr;// Pointer to allocated item
 			size_t mSize;	// Allocation size
+			bool mAligned;	// Heap block from AlignedMalloc()?
 		};
 
+		bool AddChunk (size_t size);
 		bool InStack (void * ptr) const;
-		void * AddToStack (size_t size);
+		void * AddToStack (size_t size, size_t align = eMinAlignment);
 		unsigned char * PointPast (void * ptr, size_t size) const;
 		std::vector<Item>::iterator Find (void * ptr);
+		void Add (void * ptr, size_t size, bool bAligned = false);
+		void Remove (std::vector<Item>::iterator iter);
+		void Replace (std::vector<Item>::iterator iter, void * ptr, size_t size);
 		void TryToRewind (const Item & item);
 
-		enum { eStackSize = 8192 };
+		enum { eStackSize = 8192, eMaxChunkSize = 1024 * 1024, eMaxCachedChunks = 8 };
 
 		ScopedSystem & mSystem;	// System that owns this
 		Scoped * mPrev{nullptr};// Previous entry, if any
-		unsigned char * mPos{nullptr};	// Next position in stack
-		std::vector<Item> mAllocs;	// Allocations and their info
-		std::vector<unsigned char> mStack;	// Stack for small allocations
+		unsigned char * mPos{nullptr};	// Next position in current chunk
+		std::vector<Item> mAllocs;	// Allocations and their info, in no particular order
+		PointerMap mIndices;// Position of each allocation in mAllocs
+		std::vector<std::vector<unsigned char>> mStack;	// Stack for small allocations, as a chain of chunks that
+														// double in size, up to a limit; the last chunk is current
 
 		Scoped (ScopedSystem & system);
 		~Scoped (void);
@@ -161,15 +255,18 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 	struct ScopedSystem {
 		lua_State * mL{nullptr};// Main Lua state for this
 		Scoped * mCurrent{nullptr};	// Entry currently on stack
-		std::vector<std::vector<unsigned char>> mStacks;	// Cached stacks
+		std::vector<std::vector<unsigned char>> mStacks;	// Cached stack chunks, smallest first
+		Stats mStats;	// Allocation counts
 
 		static ScopedSystem * New (lua_State * L);
 
 		Scoped Bookmark (void) { return Scoped{*this}; }
+		Scoped * FindScope (void * ptr);	// Innermost scope holding ptr, if any
 
 		// Interface
 		void FailAssert (const char * what);
 		void * Malloc (size_t size);
+		void * MallocAligned (size_t size, size_t align);
 		void * Calloc (size_t num, size_t size);
 		void * Realloc (void * ptr, size_t size);
 		void Free (void * ptr);
@@ -182,14 +279,20 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
 
     struct ScopedList {
         bool Exists (void * ptr) const;
-        void Add (void * ptr);
+        bool IsAligned (void * ptr) const;
+        void Add (void * ptr, size_t size = 0U, bool bAligned = false);
         void Remove (void * ptr);
         void RemoveAll (void);
+        void Replace (std::vector<void *>::iterator iter, void * ptr, size_t size);
+        size_t GetSize (void * ptr) const;
         std::vector<void *>::iterator Find (void * ptr);
 
         ScopedListSystem & mSystem; // System that owns this
         ScopedList * mPrev{nullptr};// Previous entry, if any
-        std::vector<void *> mPtrs;  // List of pointers
+        std::vector<void *> mPtrs;  // List of pointers, in no particular order
+        std::vector<size_t> mSizes; // Size of each allocation, parallel to mPtrs
+        std::vector<bool> mAligned; // Which allocations came from AlignedMalloc(), parallel to mPtrs
+        PointerMap mIndices;    // Position of each pointer in mPtrs
 
         ScopedList (ScopedListSystem & system);
         ~ScopedList (void);
@@ -198,16 +301,171 @@ CEU_BEGIN_NAMESPACE(MemoryXS) {
     struct ScopedListSystem {
         lua_State * mL{nullptr};// Main Lua state for this
         ScopedList * mCurrent{nullptr}; // Entry currently on stack
+        Stats mStats;   // Allocation counts
 
         static ScopedListSystem * New (lua_State * L);
 
         ScopedList Bookmark (void) { return ScopedList{*this}; }
+        ScopedList * FindList (void * ptr); // Innermost list holding ptr, if any
 
         // Interface
         void FailAssert (const char * what);
         void * Malloc (size_t size);
+        void * MallocAligned (size_t size, size_t align);
         void * Calloc (size_t num, size_t size);
         void * Realloc (void * ptr, size_t size);
         void Free (void * ptr);
+        size_t GetSize (void * ptr);
     };
+
+	// Allocator for long-lived small objects, e.g. nodes, handles, and small buffers, that would
+	// otherwise fragment the heap. Blocks come from segregated size classes, with a cache per
+	// thread in front of the shared free lists, so any thread may allocate and free; for that
+	// reason, failures return null rather than raising errors. Larger requests go to malloc().
+	// Blocks must not outlive the system. A thread new to the system adopts the cache, blocks and
+	// all, of one that has exited, so pools whose workers come and go (GCD, ConcRT) do not keep
+	// adding caches and stranding blocks in them.
+	struct PoolSystem : SizeClasses {
+		struct Cache;
+		struct Header;
+
+		enum { eCacheSize = 32 };
+
+		lua_State * mL{nullptr};// Main Lua state for this
+		std::mutex mMutex;	// Guards everything below, apart from the thread's own cache
+		void * mFree[eClassCount];	// Shared free lists, per size class
+		unsigned char * mPos{nullptr};	// Next position in current slab
+		unsigned char * mEnd{nullptr};	// End of current slab
+		std::vector<void *> mSlabs;	// Memory backing small blocks
+		std::vector<std::unique_ptr<Cache>> mCaches;// Thread caches; at most one per thread using this at any one time (see GetCache())
+		ThreadXS::TLS<Cache *> mCache;	// Calling thread's cache
+		Stats mStats;	// Allocation counts
+
+		static PoolSystem * New (lua_State * L);
+
+		PoolSystem (void);
+		~PoolSystem (void);
+
+		void * Allocate (size_t size);
+		Cache * GetCache (void);
+		void * NewBlock (int index);
+		void Release (void * ptr);
+		void Refill (Cache * cache, int index);
+		void Spill (Cache * cache, int index);
+
+		// Interface
+		void FailAssert (const char * what);
+		void * Malloc (size_t size);
+		void * MallocAligned (size_t size, size_t align);
+		void * Calloc (size_t num, size_t size);
+		void * Realloc (void * ptr, size_t size);
+		void Free (void * ptr);
+		size_t GetSize (void * ptr);
+		void Push (void * ptr, bool bRemove = true);
+	};
+
+	// Allocator for very large buffers, e.g. 8K textures or float HDR data, that maps pages straight
+	// from the OS instead of going through the heap or Lua. Fresh pages are already zeroed, and are
+	// faulted in on first touch unless populating is requested. Freed mappings have their pages
+	// released to the OS but keep their address space, and are reused by later requests. Where the
+	// OS supports it, big mappings are hinted to use transparent huge pages, and Realloc() grows a
+	// mapping by remapping it rather than copying. Any thread may use this; failures return null.
+	struct PageSystem {
+		struct Mapping {
+			void * mPtr;// Start of mapping
+			size_t mSize;	// Requested size
+			size_t mLength;	// Mapped length, in whole pages
+		};
+
+		enum { eHugePageSize = 2 * 1024 * 1024, eMaxCachedMappings = 8 };
+
+		lua_State * mL{nullptr};// Main Lua state for this
+		std::mutex mMutex;	// Guards the mappings and cache
+		std::vector<Mapping> mLive;	// Mappings in use, in no particular order
+		PointerMap mIndices;// Position of each mapping in mLive
+		std::vector<Mapping> mCache;// Released mappings available for reuse, smallest first
+		size_t mCachedBytes{0U};// Address space held by the cache
+		size_t mMaxCachedBytes{256U * 1024U * 1024U};	// Limit on mCachedBytes
+		bool mPopulate{false};	// Fault in pages up front, rather than on first touch?
+		bool mHugePages{true};	// Hint that mappings of at least eHugePageSize should use huge pages?
+		Stats mStats;	// Allocation counts
+
+		static PageSystem * New (lua_State * L);
+		static size_t GetPageSize (void);
+
+		~PageSystem (void);
+
+		static void * Map (size_t length, bool bPopulate, bool bHuge);
+		static void Unmap (void * ptr, size_t length);
+		static void Discard (void * ptr, size_t length);
+		static void Populate (void * ptr, size_t length);
+		static void * Remap (void * ptr, size_t old_length, size_t new_length);
+
+		void * Allocate (size_t size, bool & bReused);
+		size_t GetLength (size_t size, bool bHuge) const;
+		void Release (const Mapping & mapping);
+		bool Lookup (void * ptr, Mapping & mapping);
+		bool Retrack (void * ptr, Mapping & mapping, size_t length);	// Remaps first if length differs; false, tracking nothing new, on failure
+		bool Track (const Mapping & mapping);
+		bool Untrack (void * ptr, Mapping & mapping);
+		bool WantsHugePages (size_t size) const;
+
+		// Interface
+		void FailAssert (const char * what);
+		void * Malloc (size_t size);
+		void * MallocAligned (size_t size, size_t align);
+		void * Calloc (size_t num, size_t size);
+		void * Realloc (void * ptr, size_t size);
+		void Free (void * ptr);
+		size_t GetSize (void * ptr);
+		void Push (void * ptr, bool bRemove = true);
+	};
+
+	// STL allocator that routes container storage through one of the systems above, e.g. so that
+	// temporary vectors in hot paths come from a ScopedSystem's stack rather than the heap. The
+	// system must outlive the container; for a ScopedSystem, so must the current bookmark.
+	template<typename T, typename S> class SystemAllocator {
+		S * mSystem;// System supplying memory
+
+		template<typename U, typename R> friend class SystemAllocator;
+
+	public:
+		typedef T value_type;
+
+		template<typename U> struct rebind {
+			typedef SystemAllocator<U, S> other;
+		};
+
+		SystemAllocator (S & system) : mSystem{&system}
+		{
+		}
+
+		template<typename U> SystemAllocator (const SystemAllocator<U, S> & other) : mSystem{other.mSystem}
+		{
+		}
+
+		T * allocate (size_t n)
+		{
+			if (n > size_t(-1) / sizeof(T)) throw std::bad_alloc{};
+
+			void * mem = alignof(T) > eMinAlignment ? mSystem->MallocAligned(n * sizeof(T), alignof(T)) : mSystem->Malloc(n * sizeof(T));
+
+			if (!mem) throw std::bad_alloc{};
+
+			return static_cast<T *>(mem);
+		}
+
+		void deallocate (T * ptr, size_t)
+		{
+			mSystem->Free(ptr);
+		}
+
+		template<typename U> bool operator == (const SystemAllocator<U, S> & other) const { return mSystem == other.mSystem; }
+		template<typename U> bool operator != (const SystemAllocator<U, S> & other) const { return mSystem != other.mSystem; }
+	};
+
+	template<typename T> using ScopedAllocator = SystemAllocator<T, ScopedSystem>;
+	template<typename T> using ScopedListAllocator = SystemAllocator<T, ScopedListSystem>;
+	template<typename T> using PoolAllocator = SystemAllocator<T, PoolSystem>;
+	template<typename T> using PageAllocator = SystemAllocator<T, PageSystem>;
 CEU_END_NAMESPACE(MemoryXS)
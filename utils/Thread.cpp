@@ -23,15 +23,64 @@
 
 #include "utils/Thread.h"
 #include <pthread.h>
-#include <map>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#ifdef HAS_THREAD_POOL
+	#include <chrono>
+	#include <condition_variable>
+	#include <deque>
+	#include <memory>
+	#include <system_error>
+	#include <thread>
+#endif
 
 CEU_BEGIN_NAMESPACE(ThreadXS) {
+	// Per-thread value of a slot. Small values, e.g. pointers and numbers, are stored inline.
+	struct Entry {
+		enum { eInlineSize = 16 };
+
+		size_t mGeneration{0U};	// Generation of slot that last set this entry, or 0 if none
+		union {
+			unsigned char mBytes[eInlineSize];
+			double mAlign;	// Force suitable alignment
+		} mInline;	// Storage for small values
+		Slot::storage_type mLarge;	// Storage for values that will not fit inline
+
+		unsigned char * GetData (size_t size)
+		{
+			if (size <= eInlineSize) return mInline.mBytes;
+
+			if (mLarge.size() < size) mLarge.resize(size);
+
+			return mLarge.data();
+		}
+	};
+
 	//
-	using map_type = std::map<size_t, Slot::storage_type>;
+	using table_type = std::vector<Entry>;
 
 	//
 	static pthread_key_t tls_key;
 
+	// Slot indices, with a free list so that tables stay dense as slots come and go
+	struct SlotIndices {
+		std::mutex mMutex;	// Guards indices
+		std::vector<size_t> mFree;	// Released indices
+		size_t mNext{0U};	// Next fresh index
+		size_t mGeneration{0U};	// Most recent generation handed out
+	};
+
+	static SlotIndices & GetSlotIndices (void)
+	{
+		static SlotIndices sIndices;
+
+		return sIndices;
+	}
+
 	//
 	void Slot::Init (void)
 	{
@@ -40,7 +89,7 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 			{
 				pthread_key_create(&tls_key, [](void * data)
 				{
-					if (data) delete static_cast<map_type *>(data);
+					if (data) delete static_cast<table_type *>(data);
 				});
 			}
 
@@ -51,9 +100,19 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 		} sKeyLifetime;
 
 		//
-		static std::atomic<size_t> sID{0U};
+		SlotIndices & indices = GetSlotIndices();
+		std::lock_guard<std::mutex> lock{indices.mMutex};
+
+		if (!indices.mFree.empty())
+		{
+			mIndex = indices.mFree.back();
+
+			indices.mFree.pop_back();
+		}
+
+		else mIndex = indices.mNext++;
 
-		mIndex = sID++;
+		mGeneration = ++indices.mGeneration;
 	}
 
 	//
@@ -63,48 +122,846 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 	}
 
 	//
-	static void Assign (Slot::storage_type & storage, const void * var, size_t size)
+	Slot::Slot (size_t size, const void * var) : mData(size)
 	{
-		auto bytes = static_cast<const unsigned char *>(var);
+		Init();
 
-		storage.assign(bytes, bytes + size);
+		memcpy(mData.data(), var, size);
 	}
 
 	//
-	Slot::Slot (size_t size, const void * var) : mData(size)
+	Slot::~Slot (void)
 	{
-		Init();
-		Assign(mData, var, size);
+		SlotIndices & indices = GetSlotIndices();
+		std::lock_guard<std::mutex> lock{indices.mMutex};
+
+		try {
+			indices.mFree.push_back(mIndex);
+		} catch (std::bad_alloc &) {}	// Just leak the index
 	}
 
 	//
 	void Slot::GetVar (void * var)
 	{
-		map_type * tls = static_cast<map_type *>(pthread_getspecific(tls_key));
-		auto source = &mData;
+		table_type * tls = static_cast<table_type *>(pthread_getspecific(tls_key));
+		size_t size = mData.size();
 
-		if (tls)
+		if (tls && mIndex < tls->size())
 		{
-			auto iter = tls->find(mIndex);
+			Entry & entry = (*tls)[mIndex];
+
+			if (entry.mGeneration == mGeneration)
+			{
+				memcpy(var, entry.GetData(size), size);
 
-			if (iter != tls->end()) source = &iter->second;
+				return;
+			}
 		}
-		
-		memcpy(var, source->data(), mData.size());
+
+		memcpy(var, mData.data(), size);
 	}
 
 	//
 	void Slot::SetVar (const void * var)
 	{
-		map_type * tls = static_cast<map_type *>(pthread_getspecific(tls_key));
+		table_type * tls = static_cast<table_type *>(pthread_getspecific(tls_key));
 
 		if (!tls)
 		{
-			tls = new map_type;
+			tls = new table_type;
 
 			pthread_setspecific(tls_key, tls);
 		}
 
-		Assign((*tls)[mIndex], var, mData.size());
+		if (mIndex >= tls->size()) tls->resize(mIndex + 1U);
+
+		Entry & entry = (*tls)[mIndex];
+
+		entry.mGeneration = mGeneration;
+
+		memcpy(entry.GetData(mData.size()), var, mData.size());
+	}
+
+	//
+	static pthread_key_t exit_key;
+
+	//
+	std::shared_ptr<const std::atomic<bool>> GetExitFlag (void)
+	{
+		using flag_type = std::shared_ptr<std::atomic<bool>>;
+
+		static struct KeyLifetime {
+			KeyLifetime (void)
+			{
+				pthread_key_create(&exit_key, [](void * data)
+				{
+					if (!data) return;
+
+					flag_type * flag = static_cast<flag_type *>(data);
+
+					**flag = true;
+
+					delete flag;
+				});
+			}
+
+			~KeyLifetime (void)
+			{
+				pthread_key_delete(exit_key);
+			}
+		} sKeyLifetime;
+
+		flag_type * flag = static_cast<flag_type *>(pthread_getspecific(exit_key));
+
+		if (!flag)
+		{
+			flag = new flag_type{std::make_shared<std::atomic<bool>>(false)};
+
+			pthread_setspecific(exit_key, flag);
+		}
+
+		return *flag;
+	}
+
+	//
+	void * Arena::Alloc (size_t size, size_t align)
+	{
+		for (; mChunk < mChunks.size(); ++mChunk, mOffset = 0U)
+		{
+			Chunk & chunk = mChunks[mChunk];
+			uintptr_t base = reinterpret_cast<uintptr_t>(chunk.mMemory.get());
+			uintptr_t pos = (base + mOffset + align - 1U) & ~uintptr_t(align - 1U);
+
+			if (pos + size <= base + chunk.mSize)
+			{
+				mOffset = size_t(pos + size - base);
+
+				return reinterpret_cast<void *>(pos);
+			}
+		}
+
+		size_t csize = (std::max)(size + align, size_t(64U * 1024U));
+
+		if (!mChunks.empty()) csize = (std::max)(csize, 2U * mChunks.back().mSize);
+
+		mChunks.push_back(Chunk{std::unique_ptr<unsigned char[]>{new unsigned char[csize]}, csize});
+
+		mChunk = mChunks.size() - 1U;
+		mOffset = 0U;
+
+		return Alloc(size, align);
+	}
+
+	//
+	static pthread_key_t arena_key;
+
+	// Every scratch arena is registered, so that those of threads still alive at shutdown, e.g.
+	// the main thread's, whose key destructors never run, can be freed along with the key
+	static struct ArenaRegistry {
+		std::mutex mMutex;	// Guards list
+		std::vector<Arena *> mArenas;	// Live arenas
+
+		void Remove (Arena * arena)
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			mArenas.erase(std::find(mArenas.begin(), mArenas.end(), arena));
+		}
+	} * arena_registry;
+
+	//
+	Arena & Arena::GetScratch (void)
+	{
+		static struct KeyLifetime {
+			ArenaRegistry mRegistry;
+
+			KeyLifetime (void)
+			{
+				arena_registry = &mRegistry;
+
+				pthread_key_create(&arena_key, [](void * data)
+				{
+					if (!data) return;
+
+					arena_registry->Remove(static_cast<Arena *>(data));
+
+					delete static_cast<Arena *>(data);
+				});
+			}
+
+			~KeyLifetime (void)
+			{
+				pthread_key_delete(arena_key);
+
+				for (Arena * arena : mRegistry.mArenas) delete arena;
+			}
+		} sKeyLifetime;
+
+		Arena * arena = static_cast<Arena *>(pthread_getspecific(arena_key));
+
+		if (!arena)
+		{
+			arena = new Arena;
+
+			pthread_setspecific(arena_key, arena);
+
+			std::lock_guard<std::mutex> lock{arena_registry->mMutex};
+
+			arena_registry->mArenas.push_back(arena);
+		}
+
+		return *arena;
+	}
+
+	//
+	static std::atomic<bool> stats_enabled{false};
+
+	//
+	void EnableStats (bool bEnable)
+	{
+		stats_enabled = bEnable;
+	}
+
+	//
+	bool AreStatsEnabled (void)
+	{
+		return stats_enabled.load(std::memory_order_relaxed);
+	}
+
+#ifdef HAS_THREAD_POOL
+	//
+	static uint64_t Now (void)
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	//
+	static void UpdateMax (std::atomic<uint64_t> & value, uint64_t x)
+	{
+		uint64_t cur = value.load(std::memory_order_relaxed);
+
+		while (cur < x && !value.compare_exchange_weak(cur, x, std::memory_order_relaxed));
+	}
+
+	// Live counterparts of WorkerStats and LoopStats
+	struct WorkerCounters {
+		std::atomic<uint64_t> mChunks{0U}, mBusy{0U}, mIdle{0U}, mSteal{0U}, mSteals{0U}, mLongestChunk{0U};
+	};
+
+	struct LoopCounters {
+		std::atomic<uint64_t> mChunks{0U}, mBusy{0U}, mLongestChunk{0U};
+		std::atomic<uint64_t> mThreads{0U};	// Bit per thread that ran a chunk
+	};
+
+	//
+	static struct LoopHistory {
+		enum { eMaxLoops = 64 };
+
+		std::mutex mMutex;	// Guards history
+		std::deque<LoopStats> mLoops;	// Most recent loops
+		uint64_t mNextID{0U};	// ID to assign the next loop
+	} loop_history;
+
+	//
+	struct TaskQueue {
+		std::mutex mMutex;	// Guards deque
+		std::deque<Task> mTasks;// Pending tasks; owner works at the back, thieves at the front
+		std::atomic<size_t> mSize{0U};	// Number of tasks, for peeking without the lock
+		WorkerCounters mCounters;	// Stats for the queue's thread(s)
+
+		bool IsEmpty (void) const
+		{
+			return mSize.load(std::memory_order_relaxed) == 0U;
+		}
+
+		void Push (const Task & task)
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			mTasks.push_back(task);
+
+			++mSize;
+		}
+
+		bool Pop (Task & task)
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			if (mTasks.empty()) return false;
+
+			task = mTasks.back();
+
+			mTasks.pop_back();
+
+			--mSize;
+
+			return true;
+		}
+
+		bool Steal (Task & task)
+		{
+			std::lock_guard<std::mutex> lock{mMutex};
+
+			if (mTasks.empty()) return false;
+
+			task = mTasks.front();
+
+			mTasks.pop_front();
+
+			--mSize;
+
+			return true;
+		}
+	};
+
+	//
+	static THREAD_LOCAL(int) tls_worker_index = -1;
+
+	//
+	struct PoolState {
+		std::vector<std::unique_ptr<TaskQueue>> mQueues;// One per worker, followed by one shared by outside threads
+		std::vector<std::thread> mThreads;	// Worker threads
+		std::mutex mSleepMutex;	// Guards sleeping workers
+		std::condition_variable mWake;	// Signaled when work arrives or on shutdown
+		std::atomic<size_t> mQueued{0U};// Number of tasks sitting in queues
+		std::atomic<size_t> mSleeping{0U};	// Number of workers waiting on work
+		std::atomic<bool> mQuit{false};	// Shutting down?
+
+		PoolState (void)
+		{
+			unsigned int n = std::thread::hardware_concurrency();
+			size_t nworkers = n > 2U ? n - 1U : 1U; // Calling thread does its share, so leave it a core; but Launch() always needs a worker
+
+			for (size_t i = 0; i <= nworkers; ++i) mQueues.emplace_back(new TaskQueue);
+
+			try {
+				for (size_t i = 0; i < nworkers; ++i) mThreads.emplace_back([this, i]() { Work(i); });
+			} catch (std::system_error &) {}// Make do with what we have
+		}
+
+		~PoolState (void)
+		{
+			{
+				std::lock_guard<std::mutex> lock{mSleepMutex};
+
+				mQuit = true;
+			}
+
+			mWake.notify_all();
+
+			for (auto & thread : mThreads) thread.join();
+		}
+
+		size_t GetQueueIndex (void) const
+		{
+			return tls_worker_index >= 0 ? size_t(tls_worker_index) : mQueues.size() - 1U;
+		}
+
+		bool RunOne (size_t index)
+		{
+			Task task;
+			bool bFound = mQueues[index]->Pop(task);
+
+			if (!bFound)
+			{
+				uint64_t start = AreStatsEnabled() ? Now() : 0U;
+
+				for (size_t i = 1, n = mQueues.size(); !bFound && i < n; ++i) bFound = mQueues[(index + i) % n]->Steal(task);
+
+				if (start)
+				{
+					WorkerCounters & counters = mQueues[index]->mCounters;
+
+					counters.mSteal += Now() - start;
+
+					if (bFound) ++counters.mSteals;
+				}
+			}
+
+			if (!bFound) return false;
+
+			--mQueued;
+
+			task.mFunc(task.mContext, task.mBegin, task.mEnd);
+
+			task.mGroup->mPending.fetch_sub(1U, std::memory_order_release);
+
+			return true;
+		}
+
+		void Push (const Task & task)
+		{
+			++mQueued;	// Count first, so that a worker never sees a task it cannot account for
+
+			mQueues[GetQueueIndex()]->Push(task);
+
+			if (mSleeping > 0U)
+			{
+				std::lock_guard<std::mutex> lock{mSleepMutex};
+
+				mWake.notify_one();
+			}
+		}
+
+		void Work (size_t index)
+		{
+			tls_worker_index = int(index);
+
+			while (!mQuit)
+			{
+				if (RunOne(index)) continue;
+
+				std::unique_lock<std::mutex> lock{mSleepMutex};
+
+				++mSleeping;
+
+				uint64_t start = AreStatsEnabled() ? Now() : 0U;
+
+				mWake.wait(lock, [this]() { return mQueued > 0U || mQuit; });
+
+				if (start) mQueues[index]->mCounters.mIdle += Now() - start;
+
+				--mSleeping;
+			}
+		}
+	};
+
+	//
+	static PoolState & GetPool (void)
+	{
+		static PoolState sPool;
+
+		return sPool;
+	}
+
+	//
+	int Pool::GetWorkerIndex (void)
+	{
+		return tls_worker_index;
+	}
+
+	//
+	size_t Pool::GetThreadCount (void)
+	{
+		return GetPool().mThreads.size() + 1U;
+	}
+
+	//
+	struct RangeBody {
+		void (*mFunc)(void *, size_t, size_t);	// Body to run over subranges
+		void * mContext;// Context passed to body
+		size_t mGrain;	// Largest range that will not be split
+		TaskGroup * mGroup;	// Group that owns the subranges
+		LoopCounters * mLoop;	// Stats for the loop, if being gathered
+	};
+
+	//
+	static THREAD_LOCAL(int) tls_chunk_depth = 0;
+
+	//
+	static void RunChunk (RangeBody * body, size_t begin, size_t end)
+	{
+		if (!body->mLoop) body->mFunc(body->mContext, begin, end);
+
+		else
+		{
+			PoolState & pool = GetPool();
+			size_t index = pool.GetQueueIndex();
+			uint64_t start = Now();
+
+			++tls_chunk_depth;
+
+			body->mFunc(body->mContext, begin, end);
+
+			--tls_chunk_depth;
+
+			uint64_t elapsed = Now() - start;
+			WorkerCounters & counters = pool.mQueues[index]->mCounters;
+
+			++counters.mChunks;
+
+			if (tls_chunk_depth == 0) counters.mBusy += elapsed;
+
+			UpdateMax(counters.mLongestChunk, elapsed);
+
+			++body->mLoop->mChunks;
+
+			body->mLoop->mBusy += elapsed;
+			body->mLoop->mThreads.fetch_or(uint64_t(1U) << (index % 64U), std::memory_order_relaxed);
+
+			UpdateMax(body->mLoop->mLongestChunk, elapsed);
+		}
+	}
+
+	//
+	static void RecordLoop (const LoopCounters & loop, size_t n, uint64_t wall)
+	{
+		LoopStats stats;
+
+		stats.mItems = n;
+		stats.mChunks = loop.mChunks;
+		stats.mBusy = loop.mBusy;
+		stats.mWall = wall;
+		stats.mLongestChunk = loop.mLongestChunk;
+
+		for (uint64_t bits = loop.mThreads; bits; bits &= bits - 1U) ++stats.mThreads;
+
+		std::lock_guard<std::mutex> lock{loop_history.mMutex};
+
+		stats.mID = loop_history.mNextID++;
+
+		if (loop_history.mLoops.size() == LoopHistory::eMaxLoops) loop_history.mLoops.pop_front();
+
+		loop_history.mLoops.push_back(stats);
+	}
+
+	// Peel off halves of the range for others to steal, until it is small enough to just run
+	static void SplitRange (void * context, size_t begin, size_t end)
+	{
+		RangeBody * body = static_cast<RangeBody *>(context);
+
+		while (end - begin > body->mGrain)
+		{
+			size_t mid = begin + (end - begin) / 2U;
+
+			Pool::Spawn(Task{SplitRange, body, mid, end, body->mGroup});
+
+			end = mid;
+		}
+
+		RunChunk(body, begin, end);
+	}
+
+	// Lazy binary splitting: only offer up half the range when nothing else is queued up for
+	// thieves, otherwise run grain-sized pieces; see http://www.cs.umd.edu/~tzannes/papers/lbs.pdf
+	static void SplitRangeLazily (void * context, size_t begin, size_t end)
+	{
+		RangeBody * body = static_cast<RangeBody *>(context);
+		PoolState & pool = GetPool();
+		TaskQueue & queue = *pool.mQueues[pool.GetQueueIndex()];
+
+		while (end - begin > body->mGrain)
+		{
+			if (end - begin > 2U * body->mGrain && queue.IsEmpty())
+			{
+				size_t mid = begin + (end - begin) / 2U;
+
+				Pool::Spawn(Task{SplitRangeLazily, body, mid, end, body->mGroup});
+
+				end = mid;
+			}
+
+			else
+			{
+				RunChunk(body, begin, begin + body->mGrain);
+
+				begin += body->mGrain;
+			}
+		}
+
+		RunChunk(body, begin, end);
+	}
+
+	//
+	static THREAD_LOCAL(int) tls_depth = 0;
+
+	//
+	size_t Pool::GetNestingDepth (void)
+	{
+		return size_t(tls_depth);
+	}
+
+	// Loops begun inside other loops, e.g. per-channel work inside a per-tile body, split lazily:
+	// when the workers are all busy their deques are not empty, so such a loop mostly runs in
+	// place, yet idle workers can still steal from it. Since waiting threads run other tasks,
+	// nesting also deepens the stack, so past a certain depth loops simply run serially.
+	void Pool::ForRange (size_t n, size_t grain, void (*func)(void *, size_t, size_t), void * context, bool bAdaptive)
+	{
+		const int kMaxDepth = 8;
+
+		if (grain == 0U) grain = 1U;
+
+		TaskGroup group;
+		LoopCounters loop;
+		RangeBody body{func, context, grain, &group, AreStatsEnabled() ? &loop : nullptr};
+		uint64_t start = body.mLoop ? Now() : 0U;
+
+		if (n <= grain || GetThreadCount() == 1U || tls_depth >= kMaxDepth)
+		{
+			for (size_t begin = 0U; begin < n; begin += grain) RunChunk(&body, begin, (std::min)(begin + grain, n));	// Still honor the grain
+		}
+
+		else
+		{
+			if (tls_depth > 0 || GetWorkerIndex() >= 0) bAdaptive = true;
+
+			++tls_depth;
+
+			(bAdaptive ? SplitRangeLazily : SplitRange)(&body, 0U, n);
+
+			Wait(group);
+
+			--tls_depth;
+		}
+
+		if (body.mLoop) RecordLoop(loop, n, Now() - start);
+	}
+
+	//
+	void Pool::Spawn (const Task & task)
+	{
+		task.mGroup->mPending.fetch_add(1U, std::memory_order_relaxed);
+
+		GetPool().Push(task);
+	}
+
+	//
+	void Pool::Wait (TaskGroup & group)
+	{
+		PoolState & pool = GetPool();
+		size_t index = pool.GetQueueIndex();
+
+		while (group.mPending.load(std::memory_order_acquire) != 0U)
+		{
+			if (pool.RunOne(index)) continue;
+
+			uint64_t start = AreStatsEnabled() && tls_chunk_depth == 0 ? Now() : 0U;	// Waits inside chunks are busy time
+
+			std::this_thread::yield();
+
+			if (start) pool.mQueues[index]->mCounters.mIdle += Now() - start;
+		}
+	}
+
+	//
+	Stats GetStats (bool bReset)
+	{
+		Stats stats;
+
+		for (auto & queue : GetPool().mQueues)
+		{
+			WorkerCounters & counters = queue->mCounters;
+			WorkerStats ws;
+
+			ws.mChunks = bReset ? counters.mChunks.exchange(0U) : counters.mChunks.load();
+			ws.mBusy = bReset ? counters.mBusy.exchange(0U) : counters.mBusy.load();
+			ws.mIdle = bReset ? counters.mIdle.exchange(0U) : counters.mIdle.load();
+			ws.mSteal = bReset ? counters.mSteal.exchange(0U) : counters.mSteal.load();
+			ws.mSteals = bReset ? counters.mSteals.exchange(0U) : counters.mSteals.load();
+			ws.mLongestChunk = bReset ? counters.mLongestChunk.exchange(0U) : counters.mLongestChunk.load();
+
+			stats.mWorkers.push_back(ws);
+		}
+
+		std::lock_guard<std::mutex> lock{loop_history.mMutex};
+
+		stats.mLoops.assign(loop_history.mLoops.begin(), loop_history.mLoops.end());
+
+		if (bReset)
+		{
+			loop_history.mLoops.clear();
+
+			loop_history.mNextID = 0U;
+		}
+
+		return stats;
+	}
+#else
+	//
+	Stats GetStats (bool)
+	{
+		return Stats{};
+	}
+#endif
+
+	//
+	void ResetStats (void)
+	{
+		GetStats(true);
+	}
+
+	//
+	TaskGraph::node_id TaskGraph::Add (std::function<void (void)> func)
+	{
+		mNodes.emplace_back(this, mNodes.size(), std::move(func));
+
+		return mNodes.size() - 1U;
+	}
+
+	//
+	void TaskGraph::Clear (void)
+	{
+		Wait();
+
+		mNodes.clear();
+
+		mValidated = true;
+	}
+
+	//
+	void TaskGraph::Precede (node_id before, node_id after)
+	{
+		mNodes[before].mSuccessors.push_back(after);
+
+		++mNodes[after].mPredecessorCount;
+
+		mValidated = false;
+	}
+
+	//
+	bool TaskGraph::IsAcyclic (void) const
+	{
+		std::vector<size_t> counts, ready;
+
+		for (auto & node : mNodes)
+		{
+			if (node.mPredecessorCount == 0U) ready.push_back(node.mID);
+
+			counts.push_back(node.mPredecessorCount);
+		}
+
+		size_t nvisited = 0U;
+
+		for (; !ready.empty(); ++nvisited)
+		{
+			node_id id = ready.back();
+
+			ready.pop_back();
+
+			for (node_id succ : mNodes[id].mSuccessors)
+			{
+				if (--counts[succ] == 0U) ready.push_back(succ);
+			}
+		}
+
+		return nvisited == mNodes.size();
+	}
+
+	//
+	bool TaskGraph::Run (void)
+	{
+		if (!Submit()) return false;
+
+		Wait();
+
+		return true;
+	}
+
+	//
+	bool TaskGraph::Submit (void)
+	{
+		Wait();
+
+		if (!mValidated)
+		{
+			if (!IsAcyclic()) return false;
+
+			mValidated = true;
+		}
+
+		if (mNodes.empty()) return true;
+
+		for (auto & node : mNodes) node.mPending.store(node.mPredecessorCount, std::memory_order_relaxed);
+
+		mRemaining = mNodes.size();
+
+		for (auto & node : mNodes)
+		{
+			if (node.mPredecessorCount == 0U) Schedule(node.mID);
+		}
+
+		return true;
+	}
+
+	//
+	void TaskGraph::Wait (void)
+	{
+	#ifdef HAS_THREAD_POOL
+		Pool::Wait(mGroup);
+	#else
+		std::unique_lock<std::mutex> lock{mMutex};
+
+		mDone.wait(lock, [this]() { return mRemaining == 0U; });
+	#endif
+	}
+
+	// Run a task, then keep going with one of the successors it readies, scheduling the rest
+	void TaskGraph::Execute (node_id id)
+	{
+		const node_id none = mNodes.size();
+
+		for (node_id next = none; id != none; id = next, next = none)
+		{
+			Node & node = mNodes[id];
+
+			node.mFunc();
+
+			for (node_id succ : node.mSuccessors)
+			{
+				if (mNodes[succ].mPending.fetch_sub(1U, std::memory_order_acq_rel) != 1U) continue;
+
+				if (next == none) next = succ;
+
+				else Schedule(succ);
+			}
+
+			if (next == none) Finish();	// n.b. might be last use of this
+
+			else --mRemaining;	// Successor still pending, so cannot be the last task
+		}
+	}
+
+	//
+	void TaskGraph::Finish (void)
+	{
+	#ifdef HAS_THREAD_POOL
+		--mRemaining;	// Pool::Wait() tracks completion
+	#else
+		std::lock_guard<std::mutex> lock{mMutex};
+
+		if (--mRemaining == 0U) mDone.notify_all();
+	#endif
+	}
+
+	//
+	void TaskGraph::Schedule (node_id id)
+	{
+	#ifdef HAS_THREAD_POOL
+		Pool::Spawn(Task{[](void * context, size_t id, size_t)
+		{
+			static_cast<TaskGraph *>(context)->Execute(id);
+		}, this, id, id + 1U, &mGroup});
+	#else
+		Launch([](void * context)
+		{
+			Node * node = static_cast<Node *>(context);
+
+			node->mGraph->Execute(node->mID);
+		}, &mNodes[id]);
+	#endif
+	}
+
+	//
+	void Launch (void (*func)(void *), void * context)
+	{
+	#ifdef HAS_THREAD_POOL
+		static TaskGroup sDetached;	// Never waited on, but Task wants a group
+
+		if (Pool::GetThreadCount() == 1U)	// No workers could be started, so nothing would drain the queue
+		{
+			func(context);
+
+			return;
+		}
+
+		Pool::Spawn(Task{[](void * func, size_t, size_t context)
+		{
+			reinterpret_cast<void (*)(void *)>(func)(reinterpret_cast<void *>(context));
+		}, reinterpret_cast<void *>(func), 0U, reinterpret_cast<size_t>(context), &sDetached});
+	#elif defined(_WIN32)
+		Concurrency::CurrentScheduler::ScheduleTask(func, context);
+	#else
+		dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), context, func);
+	#endif
 	}
 CEU_CLOSE_NAMESPACE()
@@ -24,8 +24,18 @@
 #pragma once
 
 #include "utils/Namespace.h"
+#include <stdint.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifdef _WIN32
@@ -33,12 +43,9 @@
 #elif __APPLE__
 	#include <dispatch/dispatch.h>
 	#include "TargetConditionals.h"
-#elif __ANDROID__
-    #include <atomic>
-	#include <thread>
-	#include <numeric>
 #else
-	#error "Unsupported target"
+	// Android, Linux, etc. have no native scheduler, so we run our own pool (see Thread.cpp)
+	#define HAS_THREAD_POOL
 #endif
 
 CEU_BEGIN_NAMESPACE(ThreadXS) {
@@ -58,14 +65,19 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 		using storage_type = std::vector<unsigned char>;
 
 	private:
-		storage_type mData;
-		size_t mIndex;
+		storage_type mData;	// Default value, for threads that have not set one
+		size_t mIndex;	// Index into each thread's table; recycled once the slot goes away
+		size_t mGeneration;	// Unique to this slot, so stale entries left by an earlier owner of the index are ignored
 
 		void Init (void);
 
 	public:
 		Slot (size_t size);
 		Slot (size_t size, const void * var);
+		~Slot (void);
+
+		Slot (const Slot &) = delete;
+		Slot & operator = (const Slot &) = delete;
 
 		void GetVar (void * var);
 		void SetVar (const void * var);
@@ -112,6 +124,44 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 	#endif
 	};
 
+	// Flag set once the calling thread exits, so that per-thread state kept elsewhere, e.g. an
+	// allocator's caches, can be taken over. (The main thread's is never set.)
+	std::shared_ptr<const std::atomic<bool>> GetExitFlag (void);
+
+#ifdef HAS_THREAD_POOL
+	//
+	struct TaskGroup {
+		std::atomic<size_t> mPending{0U};	// Number of spawned tasks not yet finished
+	};
+
+	//
+	struct Task {
+		void (*mFunc)(void * context, size_t begin, size_t end);// Body to run over [begin, end)
+		void * mContext;// Context passed to body
+		size_t mBegin, mEnd;// Range of task
+		TaskGroup * mGroup;	// Group to notify on completion
+	};
+
+	// Persistent pool of workers, each with its own deque. A worker pushes and pops work at the
+	// back of its deque, while idle workers steal from the front of others'. Threads outside the
+	// pool share one extra deque. Any thread waiting on a group runs pending tasks meanwhile, so
+	// loops nested inside parallel bodies reuse the same workers rather than adding threads.
+	struct Pool {
+		static int GetWorkerIndex (void);	// -1 if not a worker
+		static size_t GetNestingDepth (void);	// Number of loops running on this thread's stack
+		static size_t GetThreadCount (void);// Workers, plus the calling thread
+		static void ForRange (size_t n, size_t grain, void (*func)(void * context, size_t begin, size_t end), void * context, bool bAdaptive = false);
+		static void Spawn (const Task & task);
+		static void Wait (TaskGroup & group);
+	};
+
+	// Default grain, giving each thread several ranges so that stealing can even out the load
+	inline size_t DefaultGrain (size_t n)
+	{
+		return (std::max)(n / (Pool::GetThreadCount() * 8U), size_t(1U));
+	}
+#endif
+
     // https://xenakios.wordpress.com/2014/09/29/concurrency-in-c-the-cross-platform-way/
     template<typename It, typename F> inline void parallel_for_each (It a, It b, F && f)
     {
@@ -128,12 +178,25 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
                              data_t * d = static_cast<data_t *>(ctx);
                              auto elem_it = d->first;
                              
-                             std::advance(elem_it, count);
+                             std::advance(elem_it, cnt);
                              
                              (*d).second(*(elem_it));
                          });
-#elif __ANDROID__
-        std::for_each(a, b, std::forward<F>(f));
+#else
+        using data_t = std::pair<It, typename std::remove_reference<F>::type *>;
+
+        size_t count = std::distance(a, b);
+        data_t helper = data_t{a, &f};
+
+        Pool::ForRange(count, DefaultGrain(count), [](void * ctx, size_t from, size_t to)
+        {
+            data_t * d = static_cast<data_t *>(ctx);
+            auto elem_it = d->first;
+
+            std::advance(elem_it, from);
+
+            for (; from < to; ++from, ++elem_it) (*d->second)(*elem_it);
+        }, &helper);
 #endif
     }
     
@@ -160,20 +223,18 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 
 			(*d).second(d->first + I1(cnt));
 		});
-	#elif __ANDROID__
-		unsigned int n = std::thread::hardware_concurrency();
-		I1 count = (std::max)(static_cast<I1>(b - a), static_cast<I1>(n)) / n;
+	#else
+		if (!(a < I1(b))) return;
 
-		std::vector<I1> splits(n);
-		
-		std::iota(splits.begin(), splits.end(), I1(0));
+		auto helper = std::make_pair(a, &f);
+		size_t count = size_t(I1(b) - a);
 
-		parallel_for_each(splits.begin(), splits.end(), [=](I1 range)
+		Pool::ForRange(count, DefaultGrain(count), [](void * ctx, size_t from, size_t to)
 		{
-			I1 from = a + range * count, to = (std::min)(from + count, static_cast<I1>(b));
+			decltype(helper) * d = static_cast<decltype(helper) *>(ctx);
 
-			while (from < to) f(from++);
-		}, n > 0U && count > I1(0));
+			for (; from < to; ++from) (*d->second)(d->first + I1(from));
+		}, &helper);
 	#endif
 	}
 
@@ -184,9 +245,890 @@ CEU_BEGIN_NAMESPACE(ThreadXS) {
 		else while (a != b) f(a++);
 	}
 
-	// parallel_reduce: http://www.idryman.org/blog/2012/08/05/grand-central-dispatch-vs-openmp/ and https://gist.github.com/m0wfo/1101546
-	// __gnu_parallel:: transform, then accumulate
-	// parallel_scan: GCD?
-	// __gnu_parallel:: prefix_sum
-	// See also thrust, etc.
+	// Number of threads the parallel algorithms may spread work across
+	inline size_t GetThreadCount (void)
+	{
+	#ifdef HAS_THREAD_POOL
+		return Pool::GetThreadCount();
+	#else
+		return (std::max)(std::thread::hardware_concurrency(), 1U);
+	#endif
+	}
+
+	// Scheduler counters, for tuning grains and spotting load imbalance. These are only gathered
+	// while enabled, and only by the thread pool; other backends report nothing. Times are in
+	// nanoseconds. Busy time counts a thread's outermost chunks, so nested loops are not counted twice.
+	struct WorkerStats {
+		uint64_t mChunks{0U};	// Chunks of loop bodies run
+		uint64_t mBusy{0U};	// Time spent running chunks
+		uint64_t mIdle{0U};	// Time spent waiting on work
+		uint64_t mSteal{0U};// Time spent looking through other threads' queues
+		uint64_t mSteals{0U};	// Tasks taken from other threads' queues
+		uint64_t mLongestChunk{0U};	// Longest single chunk
+	};
+
+	struct LoopStats {
+		uint64_t mID{0U};	// Sequence number, counting from the last reset
+		uint64_t mItems{0U};// Size of range
+		uint64_t mChunks{0U};	// Number of pieces the range was run in
+		uint64_t mBusy{0U};	// Total time spent in chunks, across threads
+		uint64_t mWall{0U};	// Time from start to finish
+		uint64_t mLongestChunk{0U};	// Longest single chunk
+		size_t mThreads{0U};// Number of threads that ran chunks
+	};
+
+	struct Stats {
+		std::vector<WorkerStats> mWorkers;	// One per worker, followed by one for outside threads
+		std::vector<LoopStats> mLoops;	// Most recent loops, oldest first
+	};
+
+	void EnableStats (bool bEnable);
+	bool AreStatsEnabled (void);
+	Stats GetStats (bool bReset = false);
+	void ResetStats (void);
+
+	// Bump allocator for scratch memory, e.g. temporary row buffers, growing in chunks. Memory is
+	// released all at once, by rewinding to an earlier mark; the chunks are kept for reuse.
+	class Arena {
+		struct Chunk {
+			std::unique_ptr<unsigned char[]> mMemory;	// Chunk memory
+			size_t mSize;	// Chunk size
+		};
+
+		std::vector<Chunk> mChunks;	// Chunks allocated so far
+		size_t mChunk{0U};	// Index of current chunk
+		size_t mOffset{0U};	// Next position in current chunk
+
+	public:
+		struct Mark {
+			size_t mChunk, mOffset;	// Saved position
+		};
+
+		void * Alloc (size_t size, size_t align = 16U);
+		Mark GetMark (void) const { return Mark{mChunk, mOffset}; }
+		void Rewind (const Mark & mark) { mChunk = mark.mChunk; mOffset = mark.mOffset; }
+		void Reset (void) { Rewind(Mark{0U, 0U}); }
+
+		template<typename T> T * AllocArray (size_t n)
+		{
+			return static_cast<T *>(Alloc(n * sizeof(T), (std::max)(std::alignment_of<T>::value, size_t(16U))));
+		}
+
+		static Arena & GetScratch (void);	// Arena belonging to the calling thread
+	};
+
+	// Call a subrange body. Bodies may take an extra Arena & parameter, to receive the running
+	// thread's scratch arena; anything they allocate from it is released when they return.
+	template<typename F, typename I> auto CallRange (F & f, I from, I to, int) -> decltype(f(from, to, std::declval<Arena &>()), void())
+	{
+		Arena & arena = Arena::GetScratch();
+		Arena::Mark mark = arena.GetMark();
+
+		f(from, to, arena);
+
+		arena.Rewind(mark);
+	}
+
+	template<typename F, typename I> void CallRange (F & f, I from, I to, long)
+	{
+		f(from, to);
+	}
+
+	// Describes how parallel_for divides a range among threads, when the body takes subranges
+	struct Partitioner {
+		size_t mGrain;	// Largest subrange handed to the body, or 0 to choose one from the range and thread count
+		bool mAdaptive;	// If true, split lazily, only as idle threads demand work; otherwise, always split down to the grain
+
+		Partitioner (void) : mGrain{0U}, mAdaptive{true}
+		{
+		}
+
+		explicit Partitioner (size_t grain, bool bAdaptive = false) : mGrain{grain}, mAdaptive{bAdaptive}
+		{
+		}
+
+		size_t GetGrain (size_t n) const
+		{
+			if (mGrain) return mGrain;
+
+			return (std::max)(n / (GetThreadCount() * (mAdaptive ? 32U : 8U)), size_t(1U));
+		}
+	};
+
+	// Variant of parallel_for whose body is called as f(from, to) on subranges of [a, b), e.g. so
+	// that it may vectorize its inner loop, with subranges no larger than the partitioner's grain.
+	// The body may also be called as f(from, to, arena); see CallRange().
+	template<typename I1, typename I2, typename F> inline void parallel_for (I1 a, I2 b, F && f, const Partitioner & partitioner)
+	{
+		if (!(a < I1(b))) return;
+
+		size_t count = size_t(I1(b) - a), grain = partitioner.GetGrain(count);
+
+	#if defined(_WIN32) || defined(__APPLE__)
+		size_t nchunks = (count + grain - 1U) / grain;
+
+		auto body = [a, count, grain, &f](size_t chunk)
+		{
+			size_t from = chunk * grain, to = (std::min)(from + grain, count);
+
+			CallRange(f, a + I1(from), a + I1(to), 0);
+		};
+
+		#ifdef _WIN32
+			Concurrency::parallel_for(size_t(0U), nchunks, body);
+		#else
+			dispatch_apply_f(nchunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), &body, [](void * ctx, size_t chunk)
+			{
+				(*static_cast<decltype(body) *>(ctx))(chunk);
+			});
+		#endif
+	#else
+		auto helper = std::make_pair(a, &f);
+
+		Pool::ForRange(count, grain, [](void * ctx, size_t from, size_t to)
+		{
+			decltype(helper) * d = static_cast<decltype(helper) *>(ctx);
+
+			CallRange(*d->second, d->first + I1(from), d->first + I1(to), 0);
+		}, &helper, partitioner.mAdaptive);
+	#endif
+	}
+
+	// Shared by a loop and those watching it: once cancelled, the loop stops handing out work,
+	// and meanwhile it counts off finished items, e.g. to drive a progress bar
+	struct LoopControl {
+		std::atomic<bool> mCancelled{false};// Has the loop been abandoned?
+		std::atomic<size_t> mCompleted{0U};	// Items finished
+		std::atomic<size_t> mTotal{0U};	// Items in all loops started so far
+
+		void Cancel (void) { mCancelled = true; }
+		bool IsCancelled (void) const { return mCancelled.load(std::memory_order_relaxed); }
+	};
+
+	// Variant of parallel_for, on subranges, that can be cancelled. A subrange is not started
+	// once the control is cancelled, so the loop stops within one subrange, i.e. one grain; this
+	// also holds when the loop runs serially, e.g. on one thread or when deeply nested, and
+	// progress is likewise counted a subrange at a time. Returns false if cancelled.
+	template<typename I1, typename I2, typename F> inline bool parallel_for (I1 a, I2 b, F && f, const Partitioner & partitioner, LoopControl & control)
+	{
+		if (a < I1(b)) control.mTotal += size_t(I1(b) - a);
+
+		parallel_for(a, b, [&f, &control](I1 from, I1 to)
+		{
+			if (control.IsCancelled()) return;	// Checked between subranges, whether split among threads or not
+
+			CallRange(f, from, to, 0);
+
+			control.mCompleted.fetch_add(size_t(to - from), std::memory_order_relaxed);
+		}, partitioner);
+
+		return !control.IsCancelled();
+	}
+
+	// Variant of parallel_for, on indices, that can be cancelled
+	template<typename I1, typename I2, typename F> inline bool parallel_for (I1 a, I2 b, F && f, LoopControl & control)
+	{
+		return parallel_for(a, b, [&f](I1 from, I1 to)
+		{
+			for (; from < to; ++from) f(from);
+		}, Partitioner{}, control);
+	}
+
+	// Rectangle of a tile visited by parallel_for_2d
+	struct Tile {
+		int mX, mY;	// Upper-left corner
+		int mW, mH;	// Dimensions, clipped to the region
+	};
+
+	// Spread a 16-bit value's bits into the even bits of the result
+	inline uint32_t SpreadBits (uint32_t v)
+	{
+		v &= 0xFFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+
+		return (v | (v << 1)) & 0x55555555;
+	}
+
+	inline uint32_t MortonCode (uint32_t x, uint32_t y)
+	{
+		return SpreadBits(x) | (SpreadBits(y) << 1);
+	}
+
+	// Visit a w x h region in tiles, calling f(tile) on each one. A non-positive tile dimension
+	// spans the whole region, e.g. tile_w = 0, tile_h = 1 gives rows. Threads receive runs of
+	// neighboring tiles, in row-major order or, if requested, Morton (Z-)order; the latter keeps
+	// each run compact in both directions, to benefit filters with vertical footprints.
+	template<typename F> inline void parallel_for_2d (int w, int h, int tile_w, int tile_h, F && f, bool bMorton = false)
+	{
+		if (w <= 0 || h <= 0) return;
+		if (tile_w <= 0 || tile_w > w) tile_w = w;
+		if (tile_h <= 0 || tile_h > h) tile_h = h;
+
+		int nx = (w + tile_w - 1) / tile_w, ny = (h + tile_h - 1) / tile_h;
+		size_t ntiles = size_t(nx) * size_t(ny);
+		std::vector<uint32_t> order;
+
+		if (bMorton && nx > 1 && ny > 1)
+		{
+			order.resize(ntiles);
+
+			for (size_t i = 0U; i < ntiles; ++i) order[i] = uint32_t(i);
+
+			std::sort(order.begin(), order.end(), [nx](uint32_t i1, uint32_t i2)
+			{
+				return MortonCode(i1 % nx, i1 / nx) < MortonCode(i2 % nx, i2 / nx);
+			});
+		}
+
+		parallel_for(size_t(0U), ntiles, [&](size_t from, size_t to)
+		{
+			for (; from < to; ++from)
+			{
+				size_t index = order.empty() ? from : order[from];
+				int x = int(index % nx) * tile_w, y = int(index / nx) * tile_h;
+
+				f(Tile{x, y, (std::min)(tile_w, w - x), (std::min)(tile_h, h - y)});
+			}
+		}, Partitioner{});
+	}
+
+	// Merge partials pairwise, in place, leaving the result in the first element
+	template<typename T, typename C> T TreeCombine (std::vector<T> & partials, C && combine)
+	{
+		for (size_t stride = 1U, n = partials.size(); stride < n; stride *= 2U)
+		{
+			for (size_t i = 0U; i + stride < n; i += 2U * stride) partials[i] = combine(partials[i], partials[i + stride]);
+		}
+
+		return partials.front();
+	}
+
+	// Reduce [0, count) as a few blocks per thread. Each block accumulates a partial via
+	// body(from, to, partial), after which the partials are combined as a tree.
+	// See also http://www.idryman.org/blog/2012/08/05/grand-central-dispatch-vs-openmp/ and https://gist.github.com/m0wfo/1101546
+	template<typename T, typename B, typename C> T ReduceInBlocks (size_t count, const T & identity, B && body, C && combine)
+	{
+		if (count == 0U) return identity;
+
+		size_t nblocks = (std::min)(count, GetThreadCount() * 4U);
+		std::vector<T> partials(nblocks, identity);
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			body(count * block / nblocks, count * (block + 1U) / nblocks, partials[block]);
+		}, nblocks > 1U);
+
+		return TreeCombine(partials, std::forward<C>(combine));
+	}
+
+	// Reduce the indices in [a, b): map(i) gives each one's contribution, which combine(x, y) merges
+	template<typename I1, typename I2, typename T, typename M, typename C> T parallel_reduce (I1 a, I2 b, T identity, M && map, C && combine)
+	{
+		if (!(a < I1(b))) return identity;
+
+		return ReduceInBlocks(size_t(I1(b) - a), identity, [&](size_t from, size_t to, T & partial)
+		{
+			for (; from < to; ++from) partial = combine(partial, map(a + I1(from)));
+		}, combine);
+	}
+
+	template<typename I1, typename I2, typename T, typename M, typename C> T parallel_reduce (I1 a, I2 b, T identity, M && map, C && combine, bool bParallel)
+	{
+		if (bParallel) return parallel_reduce(a, b, identity, std::forward<M>(map), std::forward<C>(combine));
+
+		for (; a != b; ++a) identity = combine(identity, map(a));
+
+		return identity;
+	}
+
+	// Reduce the elements in [first, last), as with std::transform_reduce
+	template<typename It, typename T, typename C, typename M> T parallel_transform_reduce (It first, It last, T identity, C && combine, M && transform)
+	{
+		return ReduceInBlocks(size_t(std::distance(first, last)), identity, [&](size_t from, size_t to, T & partial)
+		{
+			auto elem_it = first;
+
+			std::advance(elem_it, from);
+
+			for (; from < to; ++from, ++elem_it) partial = combine(partial, transform(*elem_it));
+		}, combine);
+	}
+
+	template<typename It, typename T, typename C, typename M> T parallel_transform_reduce (It first, It last, T identity, C && combine, M && transform, bool bParallel)
+	{
+		if (bParallel) return parallel_transform_reduce(first, last, identity, std::forward<C>(combine), std::forward<M>(transform));
+
+		for (; first != last; ++first) identity = combine(identity, transform(*first));
+
+		return identity;
+	}
+
+	// Reduce [0, count) as ReduceInBlocks() does, except that the blocks depend only on count, not
+	// on the number of threads, and are combined in a fixed tree. Results, e.g. float sums, are then
+	// bit-identical on any device and under any schedule, even when run serially.
+	template<typename T, typename B, typename C> T ReduceInFixedBlocks (size_t count, const T & identity, B && body, C && combine, bool bParallel = true)
+	{
+		const size_t kMinBlockSize = 1024U, kMaxBlocks = 4096U;
+
+		if (count == 0U) return identity;
+
+		size_t size = (std::max)(kMinBlockSize, (count + kMaxBlocks - 1U) / kMaxBlocks), nblocks = (count + size - 1U) / size;
+		std::vector<T> partials(nblocks, identity);
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			body(block * size, (std::min)(count, (block + 1U) * size), partials[block]);
+		}, bParallel && nblocks > 1U);
+
+		return TreeCombine(partials, std::forward<C>(combine));
+	}
+
+	// Variants of parallel_reduce() and parallel_transform_reduce() that give the same result
+	// for a given input, whatever the thread count; passing false for bParallel runs the same
+	// computation serially, for verification
+	template<typename I1, typename I2, typename T, typename M, typename C> T parallel_deterministic_reduce (I1 a, I2 b, T identity, M && map, C && combine, bool bParallel = true)
+	{
+		if (!(a < I1(b))) return identity;
+
+		return ReduceInFixedBlocks(size_t(I1(b) - a), identity, [&](size_t from, size_t to, T & partial)
+		{
+			for (; from < to; ++from) partial = combine(partial, map(a + I1(from)));
+		}, combine, bParallel);
+	}
+
+	template<typename It, typename T, typename C, typename M> T parallel_deterministic_transform_reduce (It first, It last, T identity, C && combine, M && transform, bool bParallel = true)
+	{
+		return ReduceInFixedBlocks(size_t(std::distance(first, last)), identity, [&](size_t from, size_t to, T & partial)
+		{
+			auto elem_it = first;
+
+			std::advance(elem_it, from);
+
+			for (; from < to; ++from, ++elem_it) partial = combine(partial, transform(*elem_it));
+		}, combine, bParallel);
+	}
+
+	// Scan [0, count) in two passes over a few blocks per thread. The up-sweep reduces each
+	// block via reduce(from, to); the block totals are then scanned serially, starting from
+	// init, and the down-sweep uses the results as offsets in sweep(from, to, offset).
+	// Returns the grand total.
+	template<typename T, typename C, typename R, typename S> T ScanInBlocks (size_t count, const T & init, C && combine, R && reduce, S && sweep)
+	{
+		if (count == 0U) return init;
+
+		size_t nblocks = (std::min)(count, GetThreadCount() * 4U);
+		std::vector<T> offsets(nblocks, init);
+
+		if (nblocks > 1U)
+		{
+			parallel_for(size_t(0U), nblocks - 1U, [&](size_t block)
+			{
+				offsets[block + 1U] = reduce(count * block / nblocks, count * (block + 1U) / nblocks);
+			});
+
+			for (size_t i = 1U; i < nblocks; ++i) offsets[i] = combine(offsets[i - 1U], offsets[i]);
+		}
+
+		T last = offsets.back();
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			T total = sweep(count * block / nblocks, count * (block + 1U) / nblocks, offsets[block]);
+
+			if (block + 1U == nblocks) last = total;
+		}, nblocks > 1U);
+
+		return last;
+	}
+
+	// Prefix sums of [first, last) into out (which may be first), where element i gets
+	// combine(identity, x[0], ..., x[i]). Returns the total.
+	template<typename It, typename Out, typename T, typename C> T parallel_inclusive_scan (It first, It last, Out out, C && combine, T identity)
+	{
+		return ScanInBlocks(size_t(std::distance(first, last)), identity, combine, [&](size_t from, size_t to)
+		{
+			T partial = identity;
+			auto elem_it = first;
+
+			for (std::advance(elem_it, from); from < to; ++from, ++elem_it) partial = combine(partial, *elem_it);
+
+			return partial;
+		}, [&](size_t from, size_t to, T offset)
+		{
+			auto elem_it = first;
+			auto out_it = out;
+
+			std::advance(elem_it, from);
+			std::advance(out_it, from);
+
+			for (; from < to; ++from, ++elem_it, ++out_it) *out_it = offset = combine(offset, *elem_it);
+
+			return offset;
+		});
+	}
+
+	template<typename It, typename Out> typename std::iterator_traits<It>::value_type parallel_inclusive_scan (It first, It last, Out out)
+	{
+		using value_type = typename std::iterator_traits<It>::value_type;
+
+		return parallel_inclusive_scan(first, last, out, [](const value_type & x, const value_type & y) { return x + y; }, value_type(0));
+	}
+
+	// Prefix sums of [first, last) into out (which may be first), where element i gets
+	// combine(init, x[0], ..., x[i - 1]). Returns the total, e.g. the size needed when
+	// the scan produced offsets.
+	template<typename It, typename Out, typename T, typename C> T parallel_exclusive_scan (It first, It last, Out out, T init, C && combine, T identity)
+	{
+		return ScanInBlocks(size_t(std::distance(first, last)), init, combine, [&](size_t from, size_t to)
+		{
+			T partial = identity;
+			auto elem_it = first;
+
+			for (std::advance(elem_it, from); from < to; ++from, ++elem_it) partial = combine(partial, *elem_it);
+
+			return partial;
+		}, [&](size_t from, size_t to, T offset)
+		{
+			auto elem_it = first;
+			auto out_it = out;
+
+			std::advance(elem_it, from);
+			std::advance(out_it, from);
+
+			for (; from < to; ++from, ++elem_it, ++out_it)
+			{
+				T value = *elem_it;	// Read before writing, in case out is first
+
+				*out_it = offset;
+				offset = combine(offset, value);
+			}
+
+			return offset;
+		});
+	}
+
+	template<typename It, typename Out, typename T> T parallel_exclusive_scan (It first, It last, Out out, T init)
+	{
+		return parallel_exclusive_scan(first, last, out, init, [](const T & x, const T & y) { return x + y; }, T(0));
+	}
+
+	// See also __gnu_parallel::prefix_sum, thrust, etc.
+
+	// Move count elements to another range, in parallel
+	template<typename In, typename Out> void MoveInParallel (In from, size_t count, Out to)
+	{
+		parallel_for(size_t(0U), count, [from, to](size_t first, size_t last)
+		{
+			std::move(from + first, from + last, to + first);
+		}, Partitioner{});
+	}
+
+	// Merge path split: how many of a's elements are among the first d of the stable merge of a and b
+	template<typename It1, typename It2, typename C> size_t MergeSplit (It1 a, size_t na, It2 b, size_t nb, size_t d, C & comp)
+	{
+		size_t lo = d > nb ? d - nb : 0U, hi = (std::min)(d, na);
+
+		while (lo < hi)
+		{
+			size_t i = lo + (hi - lo) / 2U;
+
+			if (!comp(b[d - i - 1U], a[i])) lo = i + 1U;	// a[i] precedes b[d - i - 1], so more of a is needed
+
+			else hi = i;
+		}
+
+		return lo;
+	}
+
+	// Merge adjacent pairs of sorted runs, `width` blocks wide, from one range into another. Each
+	// merge is itself divided along its merge path, so later rounds still keep every thread busy.
+	template<typename In, typename Out, typename C> void MergeRuns (In in, Out out, const std::vector<size_t> & bounds, size_t width, C & comp)
+	{
+		size_t nblocks = bounds.size() - 1U, npairs = nblocks / (2U * width);
+		size_t npieces = (std::max)(GetThreadCount() * 4U / npairs, size_t(1U));
+		std::vector<size_t> splits(npairs * (npieces + 1U));
+
+		// Find every split before merging, since merging moves elements out from under the searches.
+		parallel_for(size_t(0U), splits.size(), [&](size_t index)
+		{
+			size_t pair = index / (npieces + 1U), piece = index % (npieces + 1U);
+			size_t lo = bounds[2U * pair * width], mid = bounds[(2U * pair + 1U) * width], hi = bounds[(2U * pair + 2U) * width];
+
+			splits[index] = MergeSplit(in + lo, mid - lo, in + mid, hi - mid, (hi - lo) * piece / npieces, comp);
+		});
+
+		parallel_for(size_t(0U), npairs * npieces, [&](size_t index)
+		{
+			size_t pair = index / npieces, piece = index % npieces;
+			size_t lo = bounds[2U * pair * width], mid = bounds[(2U * pair + 1U) * width], hi = bounds[(2U * pair + 2U) * width];
+			size_t d0 = (hi - lo) * piece / npieces, d1 = (hi - lo) * (piece + 1U) / npieces;
+			size_t i0 = splits[pair * (npieces + 1U) + piece], i1 = splits[pair * (npieces + 1U) + piece + 1U];
+
+			std::merge(std::make_move_iterator(in + lo + i0), std::make_move_iterator(in + lo + i1),
+						std::make_move_iterator(in + mid + d0 - i0), std::make_move_iterator(in + mid + d1 - i1), out + lo + d0, comp);
+		});
+	}
+
+	// Parallel merge sort: sort a power-of-two number of blocks with sort_block(from, to), then
+	// merge them pairwise, alternating between the range and a buffer. Random-access iterators
+	// only, with a default-constructible value type.
+	template<typename It, typename C, typename S> void SortInBlocks (It first, It last, C & comp, S && sort_block)
+	{
+		size_t count = size_t(last - first), nblocks = 1U;
+
+		while (nblocks < GetThreadCount() && count / (nblocks * 2U) >= 2048U) nblocks *= 2U;
+
+		if (nblocks == 1U) sort_block(first, last);
+
+		else
+		{
+			std::vector<size_t> bounds(nblocks + 1U);
+
+			for (size_t i = 0U; i <= nblocks; ++i) bounds[i] = count * i / nblocks;
+
+			parallel_for(size_t(0U), nblocks, [&](size_t block)
+			{
+				sort_block(first + bounds[block], first + bounds[block + 1U]);
+			});
+
+			std::vector<typename std::iterator_traits<It>::value_type> buffer(count);
+			bool bInBuffer = false;
+
+			for (size_t width = 1U; width < nblocks; width *= 2U, bInBuffer = !bInBuffer)
+			{
+				if (bInBuffer) MergeRuns(buffer.begin(), first, bounds, width, comp);
+
+				else MergeRuns(first, buffer.begin(), bounds, width, comp);
+			}
+
+			if (bInBuffer) MoveInParallel(buffer.begin(), count, first);
+		}
+	}
+
+	template<typename It, typename C> void parallel_sort (It first, It last, C comp)
+	{
+		SortInBlocks(first, last, comp, [&comp](It from, It to) { std::sort(from, to, comp); });
+	}
+
+	template<typename It, typename C> void parallel_stable_sort (It first, It last, C comp)
+	{
+		SortInBlocks(first, last, comp, [&comp](It from, It to) { std::stable_sort(from, to, comp); });
+	}
+
+	template<typename It> void parallel_stable_sort (It first, It last)
+	{
+		parallel_stable_sort(first, last, std::less<typename std::iterator_traits<It>::value_type>{});
+	}
+
+	// One pass of LSD radix sort on the byte at shift, from src into dst. Each block histograms its
+	// keys; the counts are then turned into offsets, digit by digit and block by block within each
+	// digit, so that the blocks scatter in parallel and the pass stays stable. Returns false,
+	// without scattering, if every key has the same digit.
+	template<typename In, typename Out, typename K> bool RadixPass (In src, Out dst, size_t count, K & key, unsigned int shift, std::vector<size_t> & counts)
+	{
+		size_t nblocks = counts.size() / 256U;
+
+		std::fill(counts.begin(), counts.end(), size_t(0U));
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			size_t * hist = &counts[block * 256U];
+
+			for (size_t i = count * block / nblocks, end = count * (block + 1U) / nblocks; i < end; ++i) ++hist[(key(src[i]) >> shift) & 0xFF];
+		}, nblocks > 1U);
+
+		size_t sum = 0U;
+
+		for (size_t digit = 0U; digit < 256U; ++digit)
+		{
+			size_t total = 0U;
+
+			for (size_t block = 0U; block < nblocks; ++block) total += counts[block * 256U + digit];
+
+			if (total == count) return false;
+
+			for (size_t block = 0U; block < nblocks; ++block)
+			{
+				size_t & n = counts[block * 256U + digit];
+				size_t offset = sum;
+
+				sum += n;
+				n = offset;
+			}
+		}
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			size_t * offsets = &counts[block * 256U];
+
+			for (size_t i = count * block / nblocks, end = count * (block + 1U) / nblocks; i < end; ++i)
+			{
+				size_t digit = (key(src[i]) >> shift) & 0xFF;
+
+				dst[offsets[digit]++] = std::move(src[i]);
+			}
+		}, nblocks > 1U);
+
+		return true;
+	}
+
+	// Stable sort by an unsigned integer key, e.g. a depth or bucket index, given by key(elem)
+	template<typename It, typename K> void parallel_radix_sort (It first, It last, K key)
+	{
+		using key_type = typename std::decay<decltype(key(*first))>::type;
+
+		static_assert(std::is_integral<key_type>::value && std::is_unsigned<key_type>::value, "Radix sort keys must be unsigned integers");
+
+		size_t count = size_t(last - first);
+
+		if (count < 2U) return;
+
+		std::vector<typename std::iterator_traits<It>::value_type> buffer(count);
+		std::vector<size_t> counts((std::min)(GetThreadCount() * 4U, (count + 4095U) / 4096U) * 256U);
+		bool bInBuffer = false;
+
+		for (unsigned int shift = 0U; shift < sizeof(key_type) * 8U; shift += 8U)
+		{
+			bool bMoved = bInBuffer ? RadixPass(buffer.begin(), first, count, key, shift, counts) : RadixPass(first, buffer.begin(), count, key, shift, counts);
+
+			if (bMoved) bInBuffer = !bInBuffer;
+		}
+
+		if (bInBuffer) MoveInParallel(buffer.begin(), count, first);
+	}
+
+	// Map integers to unsigned keys that sort in the same order
+	template<typename T> typename std::make_unsigned<T>::type RadixKey (T x)
+	{
+		using key_type = typename std::make_unsigned<T>::type;
+
+		return std::is_signed<T>::value ? key_type(x) ^ (key_type(1U) << (sizeof(T) * 8U - 1U)) : key_type(x);
+	}
+
+	template<typename It> void SortByValue (It first, It last, std::true_type)	// 32- and 64-bit integers
+	{
+		using value_type = typename std::iterator_traits<It>::value_type;
+
+		if (last - first < 4096) std::sort(first, last);
+
+		else parallel_radix_sort(first, last, RadixKey<value_type>);
+	}
+
+	template<typename It> void SortByValue (It first, It last, std::false_type)
+	{
+		parallel_sort(first, last, std::less<typename std::iterator_traits<It>::value_type>{});
+	}
+
+	// Sort by operator <, using radix sort on large ranges of 32- or 64-bit integers
+	template<typename It> void parallel_sort (It first, It last)
+	{
+		using value_type = typename std::iterator_traits<It>::value_type;
+
+		SortByValue(first, last, std::integral_constant<bool, std::is_integral<value_type>::value && !std::is_same<value_type, bool>::value && (sizeof(value_type) == 4U || sizeof(value_type) == 8U)>{});
+	}
+
+	// Stable partition: elements satisfying pred are moved in front of those that do not, each
+	// group keeping its order. Returns the partition point.
+	template<typename It, typename P> It parallel_partition (It first, It last, P pred)
+	{
+		size_t count = size_t(last - first), nblocks = (std::min)(GetThreadCount() * 4U, count / 4096U);
+
+		if (nblocks <= 1U) return std::stable_partition(first, last, pred);
+
+		std::vector<unsigned char> flags(count);
+		std::vector<size_t> offsets(nblocks + 1U, 0U);
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			size_t ntrue = 0U;
+
+			for (size_t i = count * block / nblocks, end = count * (block + 1U) / nblocks; i < end; ++i)
+			{
+				flags[i] = pred(first[i]) ? 1U : 0U;
+				ntrue += flags[i];
+			}
+
+			offsets[block + 1U] = ntrue;
+		});
+
+		for (size_t i = 1U; i <= nblocks; ++i) offsets[i] += offsets[i - 1U];
+
+		std::vector<typename std::iterator_traits<It>::value_type> buffer(count);
+		size_t ntrue = offsets.back();
+
+		parallel_for(size_t(0U), nblocks, [&](size_t block)
+		{
+			size_t i = count * block / nblocks, end = count * (block + 1U) / nblocks;
+			size_t t = offsets[block], f = ntrue + i - offsets[block];	// Falses so far are the indices less the trues
+
+			for (; i < end; ++i) buffer[flags[i] ? t++ : f++] = std::move(first[i]);
+		});
+
+		MoveInParallel(buffer.begin(), count, first);
+
+		return first + ntrue;
+	}
+
+	// Run func(context) on a worker, without waiting on it
+	void Launch (void (*func)(void * context), void * context);
+
+	// Graph of tasks, each of which may wait on others to finish. Tasks run as they become ready,
+	// so independent branches overlap. Once built, a graph may be run any number of times
+	// without allocating, e.g. once per frame.
+	class TaskGraph {
+	public:
+		using node_id = size_t;
+
+	private:
+		struct Node {
+			std::function<void (void)> mFunc;	// Body
+			std::vector<node_id> mSuccessors;	// Tasks waiting on this one
+			size_t mPredecessorCount{0U};	// Number of tasks this one waits on
+			std::atomic<size_t> mPending{0U};	// Predecessors yet to finish in the current run
+			TaskGraph * mGraph;	// Graph that owns this
+			node_id mID;	// Position in graph
+
+			Node (TaskGraph * graph, node_id id, std::function<void (void)> && func) : mFunc{std::move(func)}, mGraph{graph}, mID{id}
+			{
+			}
+		};
+
+		std::deque<Node> mNodes;// Tasks; a deque, so that nodes stay put as more are added
+		std::atomic<size_t> mRemaining{0U};	// Tasks yet to finish in the current run
+		bool mValidated{true};	// Has the graph been checked for cycles since it last changed?
+
+	#ifdef HAS_THREAD_POOL
+		TaskGroup mGroup;	// Tasks spawned in the current run
+	#else
+		std::mutex mMutex;	// Guards completion
+		std::condition_variable mDone;	// Signaled when the last task finishes
+	#endif
+
+		bool IsAcyclic (void) const;
+		void Execute (node_id id);
+		void Finish (void);
+		void Schedule (node_id id);
+
+	public:
+		TaskGraph (void) = default;
+		TaskGraph (const TaskGraph &) = delete;
+		TaskGraph & operator = (const TaskGraph &) = delete;
+		~TaskGraph (void) { Wait(); }
+
+		node_id Add (std::function<void (void)> func);
+		size_t GetCount (void) const { return mNodes.size(); }
+		void Clear (void);
+		void Precede (node_id before, node_id after);	// after will wait on before
+		bool Run (void);// Submit, then wait; false if the graph has a cycle
+		bool Submit (void);	// Start a run, without waiting on it
+		void Wait (void);	// Wait on the current run, if any
+	};
+
+	// Bounded queue that any number of threads may push into and pop from, without locking. Each
+	// cell carries a sequence number that says whose turn it is, so producers and consumers only
+	// contend on their respective indices. The capacity is rounded up to a power of 2.
+	template<typename T> class RingQueue {
+		struct Cell {
+			std::atomic<size_t> mSequence;	// Turn of the next access to this cell
+			T mValue;	// Stored value
+		};
+
+		enum { eLineSize = 64 };
+
+		std::vector<Cell> mCells;	// Storage
+		size_t mMask;	// Capacity - 1, for wrapping
+		char mPad1[eLineSize];	// Keep the indices on separate cache lines
+		std::atomic<size_t> mTail{0U};	// Next position to push
+		char mPad2[eLineSize];
+		std::atomic<size_t> mHead{0U};	// Next position to pop
+		char mPad3[eLineSize];
+
+		static size_t RoundUp (size_t n)
+		{
+			size_t power = 2U;
+
+			while (power < n) power *= 2U;
+
+			return power;
+		}
+
+		template<typename U> bool AuxPush (U && value)
+		{
+			size_t pos = mTail.load(std::memory_order_relaxed);
+
+			for (;;)
+			{
+				Cell & cell = mCells[pos & mMask];
+				size_t seq = cell.mSequence.load(std::memory_order_acquire);
+				intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+				if (diff == 0)
+				{
+					if (mTail.compare_exchange_weak(pos, pos + 1U, std::memory_order_relaxed))
+					{
+						cell.mValue = std::forward<U>(value);
+
+						cell.mSequence.store(pos + 1U, std::memory_order_release);
+
+						return true;
+					}
+				}
+
+				else if (diff < 0) return false;// full
+
+				else pos = mTail.load(std::memory_order_relaxed);
+			}
+		}
+
+	public:
+		explicit RingQueue (size_t capacity) : mCells(RoundUp(capacity)), mMask{mCells.size() - 1U}
+		{
+			for (size_t i = 0; i < mCells.size(); ++i) mCells[i].mSequence.store(i, std::memory_order_relaxed);
+		}
+
+		RingQueue (const RingQueue &) = delete;
+		RingQueue & operator = (const RingQueue &) = delete;
+
+		bool TryPush (const T & value) { return AuxPush(value); }
+		bool TryPush (T && value) { return AuxPush(std::move(value)); }
+
+		bool TryPop (T & value)
+		{
+			size_t pos = mHead.load(std::memory_order_relaxed);
+
+			for (;;)
+			{
+				Cell & cell = mCells[pos & mMask];
+				size_t seq = cell.mSequence.load(std::memory_order_acquire);
+				intptr_t diff = intptr_t(seq) - intptr_t(pos + 1U);
+
+				if (diff == 0)
+				{
+					if (mHead.compare_exchange_weak(pos, pos + 1U, std::memory_order_relaxed))
+					{
+						value = std::move(cell.mValue);
+
+						cell.mSequence.store(pos + mMask + 1U, std::memory_order_release);
+
+						return true;
+					}
+				}
+
+				else if (diff < 0) return false;// empty
+
+				else pos = mHead.load(std::memory_order_relaxed);
+			}
+		}
+
+		size_t GetCapacity (void) const { return mCells.size(); }
+
+		size_t GetSizeApprox (void) const	// Only a snapshot, while other threads are busy
+		{
+			size_t head = mHead.load(std::memory_order_relaxed), tail = mTail.load(std::memory_order_relaxed);
+
+			return tail > head ? tail - head : 0U;
+		}
+	};
 CEU_END_NAMESPACE(ThreadXS)